@@ -9,19 +9,51 @@
 #include <iomanip>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <vector>
 #include <limits>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <atomic>
 
 #ifdef __APPLE__
 
 #include <GLUT/glut.h>
 #define GL_SILENCE_DEPRECATION
 
-#else
+#elif defined(_WIN32)
 
+#define NOMINMAX // keep std::min and std::max usable
 #include <windows.h>
 #include <GL/glut.h>
 
+#else
+
+#include <GL/glut.h>
+
+#endif
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sched.h>
 #endif
 
 #define epsilon 0.0000001
@@ -107,22 +139,42 @@ double distance_between_points(const Point3D &a, const Point3D &b)
     return sqrt((a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z));
 }
 
+// shape of a light, area lights cast soft shadows
+enum LightShape { LIGHT_POINT, LIGHT_SPHERE, LIGHT_QUAD };
+
 class Light{
 
 public:
-    Point3D source_light_position;
+    Point3D source_light_position; // center of an area light
     vector<double> color;
+    double influence_radius; // 0 means the light reaches everywhere without attenuation
+    int shape;
+    double sphere_radius;
+    Point3D quad_corner, quad_edge_u, quad_edge_v; // the quad spans corner + u * edge_u + v * edge_v, u and v in [0, 1]
+    bool is_spotlight; // lights only the cone around spot_direction, fading out between the inner and outer angle
+    Point3D spot_direction;
+    double spot_outer_angle, spot_cos_inner, spot_cos_outer;
 
     Light()
     {
         source_light_position = Point3D();
         color.resize(3);
+        influence_radius = 0.0;
+        shape = LIGHT_POINT;
+        sphere_radius = 0.0;
+        is_spotlight = false;
+        spot_outer_angle = spot_cos_inner = spot_cos_outer = 0.0;
     }
 
     Light(const Point3D &source)
     {
         source_light_position = source;
         color.resize(3);
+        influence_radius = 0.0;
+        shape = LIGHT_POINT;
+        sphere_radius = 0.0;
+        is_spotlight = false;
+        spot_outer_angle = spot_cos_inner = spot_cos_outer = 0.0;
     }
 
     void set_color(double r, double g, double b)
@@ -132,18 +184,134 @@ public:
         this->color[2] = b;
     }
     
+    void set_influence_radius(double radius)
+    {
+        this->influence_radius = radius;
+    }
+    
+    void set_sphere_shape(double radius)
+    {
+        this->shape = LIGHT_SPHERE;
+        this->sphere_radius = radius;
+    }
+    
+    void set_quad_shape(const Point3D &corner, const Point3D &edge_u, const Point3D &edge_v)
+    {
+        this->shape = LIGHT_QUAD;
+        this->quad_corner = corner;
+        this->quad_edge_u = edge_u;
+        this->quad_edge_v = edge_v;
+        this->source_light_position = corner + (edge_u + edge_v) * 0.5;
+    }
+    
+    // angles in radians, inner <= outer
+    void set_spot_cone(const Point3D &direction, double inner_angle, double outer_angle)
+    {
+        this->is_spotlight = true;
+        this->spot_direction = direction;
+        this->spot_direction.normalize_point();
+        this->spot_outer_angle = outer_angle;
+        this->spot_cos_inner = cos(inner_angle);
+        this->spot_cos_outer = cos(outer_angle);
+    }
+    
+    // 1 inside the inner cone, 0 outside the outer cone, smooth in between
+    double get_spot_factor(const Point3D &point) const
+    {
+        if(!is_spotlight) return 1.0;
+        
+        Point3D direction = point - source_light_position;
+        direction.normalize_point();
+        double cos_angle = vector_dot_product(direction, spot_direction);
+        
+        if(cos_angle <= spot_cos_outer) return 0.0;
+        if(cos_angle >= spot_cos_inner) return 1.0;
+        
+        double t = (cos_angle - spot_cos_outer) / (spot_cos_inner - spot_cos_outer);
+        return t * t * (3.0 - 2.0 * t);
+    }
+    
+    // false when no point of the sphere is inside the outer cone
+    bool does_spot_cone_reach(const Point3D &center, double radius) const
+    {
+        if(!is_spotlight) return true;
+        
+        Point3D v = center - source_light_position;
+        double distance = sqrt(vector_dot_product(v, v));
+        
+        if(distance <= radius) return true;
+        
+        double angle = acos(max(-1.0, min(1.0, vector_dot_product(v, spot_direction) / distance)));
+        return angle - asin(radius / distance) <= spot_outer_angle;
+    }
+    
+    bool is_area_light() const
+    {
+        return shape != LIGHT_POINT;
+    }
+    
+    // largest distance from source_light_position to a point of the light
+    double get_extent() const
+    {
+        if(shape == LIGHT_SPHERE) return sphere_radius;
+        if(shape == LIGHT_QUAD) return 0.5 * max(distance_between_points(quad_edge_u, quad_edge_v * -1.0), distance_between_points(quad_edge_u, quad_edge_v));
+        
+        return 0.0;
+    }
+    
+    // point of the light for the sample (u1, u2) in [0, 1)^2. A sphere is sampled on its disk facing point
+    Point3D get_sample_position(const Point3D &point, double u1, double u2) const
+    {
+        if(shape == LIGHT_QUAD) return quad_corner + quad_edge_u * u1 + quad_edge_v * u2;
+        if(shape == LIGHT_POINT) return source_light_position;
+        
+        Point3D w = point - source_light_position;
+        w.normalize_point();
+        Point3D u = vector_cross_product(fabs(w.x) > 0.5 ? Point3D(0, 1, 0) : Point3D(1, 0, 0), w);
+        u.normalize_point();
+        Point3D v = vector_cross_product(w, u);
+        
+        double r = sphere_radius * sqrt(u1), phi = 2 * 3.14159265358979323846 * u2;
+        return source_light_position + u * (r * cos(phi)) + v * (r * sin(phi));
+    }
+    
+    // smooth falloff from 1 at the light to 0 at influence_radius
+    double get_attenuation(double distance) const
+    {
+        if(influence_radius <= 0.0) return 1.0;
+        if(distance >= influence_radius) return 0.0;
+        
+        double ratio = distance / influence_radius;
+        return (1.0 - ratio * ratio) * (1.0 - ratio * ratio);
+    }
+    
     void draw_light_source()
     {
+        glColor3f(color[0], color[1], color[2]);
+        
+        if(shape == LIGHT_QUAD)
+        {
+            Point3D corners[4] = {quad_corner, quad_corner + quad_edge_u, quad_corner + quad_edge_u + quad_edge_v, quad_corner + quad_edge_v};
+            
+            glBegin(GL_QUADS);
+            for(int i = 0; i < 4; i++)
+            {
+                glVertex3f(corners[i].x, corners[i].y, corners[i].z);
+            }
+            glEnd();
+            return;
+        }
+        
         glPushMatrix();
         glTranslatef(source_light_position.x, source_light_position.y, source_light_position.z);
-        glColor3f(color[0], color[1], color[2]);
-        glutSolidSphere(2, 100, 100);
+        glutSolidSphere(shape == LIGHT_SPHERE ? sphere_radius : 2, 100, 100);
         glPopMatrix();
     }
 
     void print_light_info()
     {
-        cout << "position of the point light source: ";
+        const char *shape_names[] = {"point", "sphere", "quad"};
+        cout << "position of the " << shape_names[shape] << (is_spotlight ? " spot" : "") << " light source: ";
         source_light_position.printPoint();
         cout << "RGB color value:  R: " << color[0] << "   G: " << color[1] << "   B: " << color[2] << endl;
     }
@@ -159,9 +327,12 @@ class Ray{
 
 public:
     Point3D start, direction;
+    bool from_shared_origin; // true when start is the origin passed to Object::precompute_origin_terms()
+
     Ray()
     {
         this->start = this->direction = Point3D(0, 0, 0);
+        this->from_shared_origin = false;
     }
 
     Ray(const Point3D &start, const Point3D &direction)
@@ -169,6 +340,7 @@ public:
         this->start = start;
         this->direction = direction; // normalize for easier calculations
         this->direction.normalize_point();
+        this->from_shared_origin = false;
     }
 
     void print_ray()
@@ -185,22 +357,320 @@ public:
     }
 };
 
+// material feature bits, ambient is always on
+#define MATERIAL_DIFFUSE 1
+#define MATERIAL_SPECULAR 2
+#define MATERIAL_REFLECTIVE 4
+#define NUM_OF_MATERIAL_KERNELS 8
+
+/*
+ Shadow rays towards the same light in structure of arrays layout, so the occlusion tests below run
+ the same arithmetic on every lane and the compiler can vectorize them. Unused lanes have distance -1.
+ */
+#define SHADOW_PACKET_SIZE 8
+
+struct ShadowRayPacket{
+    int size;
+    double start_x[SHADOW_PACKET_SIZE], start_y[SHADOW_PACKET_SIZE], start_z[SHADOW_PACKET_SIZE];
+    double direction_x[SHADOW_PACKET_SIZE], direction_y[SHADOW_PACKET_SIZE], direction_z[SHADOW_PACKET_SIZE];
+    double distance[SHADOW_PACKET_SIZE]; // a lane is occluded by a hit with 0 < t <= distance
+};
+
+/*
+ Out-of-core mode (--memory-cap). Only two arrays of the scene are paged: the triangle vertices and the
+ occluder grids of the lights. They are written to scratch files and memory mapped, so only the pages rays
+ actually touch are resident and the OS can drop the others. The mappings are private, reading never dirties
+ a page, so release_resident_pages() can hand them all back and they are read again from the file when
+ needed. Spheres, quadrics, the floor, the lights and the object list stay on the heap: they take a few
+ hundred bytes each, so a scene made of them has nothing to page and the cap only shortens the output bands.
+ */
+#define PAGE_FILE_ALIGNMENT 64
+
+bool out_of_core_rendering = false;
+size_t memory_cap_bytes = 0;
+
+class PageFile{
+
+    string file_name;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#else
+    int file;
+#endif
+    char *view;
+    size_t num_of_bytes; // written so far
+
+public:
+    explicit PageFile(const string &file_name) : file_name(file_name)
+    {
+#ifdef _WIN32
+        file = INVALID_HANDLE_VALUE;
+        mapping = NULL;
+#else
+        file = -1;
+#endif
+        view = nullptr;
+        num_of_bytes = 0;
+    }
+    
+    // drops the mapping and starts an empty file
+    bool reset()
+    {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(file_name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+        if(file == INVALID_HANDLE_VALUE)
+#else
+        file = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if(file >= 0) unlink(file_name.c_str()); // the data goes away with the descriptor
+        else
+#endif
+        {
+            cout << "PageFile: could not create " << file_name << endl;
+            return false;
+        }
+        return true;
+    }
+    
+    // offset of the data in the file, valid for get() after map()
+    size_t append(const void *data, size_t size)
+    {
+        static const char zeros[PAGE_FILE_ALIGNMENT] = {0};
+        size_t padding = (PAGE_FILE_ALIGNMENT - num_of_bytes % PAGE_FILE_ALIGNMENT) % PAGE_FILE_ALIGNMENT;
+        
+        write_bytes(zeros, padding);
+        size_t offset = num_of_bytes;
+        write_bytes((const char *) data, size);
+        return offset;
+    }
+    
+    bool map()
+    {
+        if(num_of_bytes == 0) return true;
+#ifdef _WIN32
+        mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        if(mapping != NULL) view = (char *) MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, num_of_bytes);
+#else
+        void *address = mmap(nullptr, num_of_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+        if(address != MAP_FAILED) view = (char *) address;
+#endif
+        if(view == nullptr) cout << "PageFile: could not map " << file_name << endl;
+        return view != nullptr;
+    }
+    
+    char *get(size_t offset)
+    {
+        return view + offset;
+    }
+    
+    size_t size() const
+    {
+        return num_of_bytes;
+    }
+    
+    void release_resident_pages()
+    {
+        if(view == nullptr) return;
+#ifdef _WIN32
+        VirtualUnlock(view, num_of_bytes); // unlocking pages that are not locked takes them out of the working set
+#else
+        madvise(view, num_of_bytes, MADV_DONTNEED);
+#endif
+    }
+    
+    void close()
+    {
+#ifdef _WIN32
+        if(view != nullptr) UnmapViewOfFile(view);
+        if(mapping != NULL) CloseHandle(mapping);
+        if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        mapping = NULL;
+#else
+        if(view != nullptr) munmap(view, num_of_bytes);
+        if(file >= 0) ::close(file);
+        file = -1;
+#endif
+        view = nullptr;
+        num_of_bytes = 0;
+    }
+    
+    ~PageFile()
+    {
+        close();
+    }
+
+private:
+    void write_bytes(const char *data, size_t size)
+    {
+        while(size > 0)
+        {
+#ifdef _WIN32
+            DWORD written = 0;
+            if(!WriteFile(file, data, (DWORD) min(size, (size_t) 1 << 30), &written, NULL)) written = 0;
+#else
+            ssize_t written = write(file, data, size);
+#endif
+            if(written <= 0)
+            {
+                cout << "PageFile: could not write " << file_name << endl;
+                return;
+            }
+            data += written;
+            size -= written;
+            num_of_bytes += written;
+        }
+    }
+};
+
+PageFile geometry_page_file("1605084_geometry.page"); // triangle vertices, written once after load_data()
+PageFile occluder_page_file("1605084_occluders.page"); // occluder grids, rewritten by build_light_occluder_grids()
+
+/*
+ Array that lives in a vector until page_out() and attach() move it into a PageFile. Indexing costs the
+ same in both states, so the code that reads the scene does not care where the elements are.
+ */
+template<typename T>
+class PagedArray{
+
+    vector<T> storage;
+    T *elements; // storage.data() or a place in the mapped file
+    size_t num_of_elements;
+    size_t page_offset;
+    bool is_paged;
+
+    void sync()
+    {
+        elements = storage.data();
+        num_of_elements = storage.size();
+    }
+
+public:
+    PagedArray() : elements(nullptr), num_of_elements(0), page_offset(0), is_paged(false) {}
+    
+    PagedArray(const PagedArray &other)
+    {
+        *this = other;
+    }
+    
+    PagedArray &operator=(const PagedArray &other)
+    {
+        storage = other.storage;
+        page_offset = other.page_offset;
+        is_paged = other.is_paged;
+        sync();
+        if(is_paged)
+        {
+            elements = other.elements; // the mapping is shared
+            num_of_elements = other.num_of_elements;
+        }
+        return *this;
+    }
+    
+    void assign(size_t n, const T &value) { storage.assign(n, value); is_paged = false; sync(); }
+    void resize(size_t n) { storage.resize(n); is_paged = false; sync(); }
+    void push_back(const T &value)
+    {
+        if(is_paged)
+        {
+            // readers use the mapping, an element added to the vector would never be seen
+            cout << "PagedArray: push_back() after attach(), call assign(), resize() or clear() first" << endl;
+            return;
+        }
+        storage.push_back(value);
+        sync();
+    }
+    void clear() { storage.clear(); is_paged = false; sync(); }
+    
+    size_t size() const { return num_of_elements; }
+    T &operator[](size_t i) { return elements[i]; }
+    const T &operator[](size_t i) const { return elements[i]; }
+    
+    // first step: copy the elements into the file
+    void page_out(PageFile &file)
+    {
+        if(!is_paged && num_of_elements > 0) page_offset = file.append(storage.data(), num_of_elements * sizeof(T));
+    }
+    
+    // second step, after file.map(): read the elements from the mapping and free the vector
+    void attach(PageFile &file)
+    {
+        if(is_paged || num_of_elements == 0) return;
+        
+        elements = (T *) file.get(page_offset);
+        is_paged = true;
+        vector<T>().swap(storage);
+    }
+};
+
+size_t get_resident_memory()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return counters.WorkingSetSize;
+#elif defined(__APPLE__)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if(task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t) &info, &count) == KERN_SUCCESS) return info.resident_size;
+#else
+    long num_of_pages = 0, num_of_resident_pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if(statm != nullptr)
+    {
+        if(fscanf(statm, "%ld %ld", &num_of_pages, &num_of_resident_pages) != 2) num_of_resident_pages = 0;
+        fclose(statm);
+    }
+    return (size_t) num_of_resident_pages * sysconf(_SC_PAGESIZE);
+#endif
+    return 0;
+}
+
+size_t get_peak_resident_memory()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return counters.PeakWorkingSetSize;
+    return 0;
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss; // bytes
+#else
+    return (size_t) usage.ru_maxrss * 1024; // kilobytes
+#endif
+#endif
+}
+
+// hands the mapped pages back when the process is above the cap
+void trim_paged_memory()
+{
+    if(!out_of_core_rendering || get_resident_memory() <= memory_cap_bytes) return;
+    
+    geometry_page_file.release_resident_pages();
+    occluder_page_file.release_resident_pages();
+}
+
 class Object{
 
 public:
     Point3D reference_point;
-    vector<Point3D> triangle_end_points;
+    PagedArray<Point3D> triangle_end_points;
     vector<double> gen_obj_coefficients;
 
     double height, width, length;
     vector<double> color;
     vector<double> reflection_coefficients; // reflection coefficients --> 0-ambient, 1-diffuse, 2-specular, 3-recursive reflection;
     int shininess; // exponent term of specular component
+    int material_mask; // MATERIAL_* bits of the non zero reflection coefficients, picks the shading kernel
 
     Object()
     {
         color.resize(3);
         reflection_coefficients.resize(4);
+        height = width = length = 0.0;
+        shininess = 0;
+        material_mask = 0;
     }
 
     void set_color(double r, double g, double b)
@@ -222,6 +692,16 @@ public:
         this->reflection_coefficients[1] = dif;
         this->reflection_coefficients[2] = spec;
         this->reflection_coefficients[3] = rec_ref;
+        
+        classify_material();
+    }
+    
+    void classify_material()
+    {
+        material_mask = 0;
+        if(reflection_coefficients[1] != 0) material_mask |= MATERIAL_DIFFUSE;
+        if(reflection_coefficients[2] != 0) material_mask |= MATERIAL_SPECULAR;
+        if(reflection_coefficients[3] != 0) material_mask |= MATERIAL_REFLECTIVE;
     }
 
     Point3D get_reflection_vector(Point3D const &incident_vector, Point3D const &normal)
@@ -235,6 +715,14 @@ public:
     
     virtual void draw(){}
     
+    virtual void get_surface_color(const Point3D &intersection_point, double surface_color[3])
+    {
+        for(int i = 0; i < 3; i++)
+        {
+            surface_color[i] = color[i];
+        }
+    }
+    
     virtual Point3D get_normal_vector(const Point3D &intersection_point)
     {
         return Point3D();
@@ -245,88 +733,1554 @@ public:
     {
         return -1.0;
     }
+    
+    // Cache the terms of the intersection equation that depend only on the ray origin.
+    // All primary rays start at the eye, so capture() calls this once per frame instead of once per pixel.
+    virtual void precompute_origin_terms(const Point3D &origin){}
+    
+    virtual double get_shared_origin_t_value(const Ray &ray)
+    {
+        return get_intersection_point_t_value(ray);
+    }
+    
+    double get_t_value(const Ray &ray)
+    {
+        if(ray.from_shared_origin) return get_shared_origin_t_value(ray);
+        
+        return get_intersection_point_t_value(ray);
+    }
+
+    virtual double intersect(const Ray &ray, vector<double> &changed_color, int level)
+    {
+        return -1.0;
+    }
+    
+    // sets occluded[k] for every lane of the packet blocked by this object
+    virtual void occlude_packet(const ShadowRayPacket &packet, char occluded[])
+    {
+        for(int k = 0; k < packet.size; k++)
+        {
+            if(occluded[k]) continue;
+            
+            Ray ray;
+            ray.start = Point3D(packet.start_x[k], packet.start_y[k], packet.start_z[k]);
+            ray.direction = Point3D(packet.direction_x[k], packet.direction_y[k], packet.direction_z[k]);
+            
+            double t_value = get_intersection_point_t_value(ray);
+            occluded[k] = t_value > 0.0 && t_value <= packet.distance[k];
+        }
+    }
+    
+    // false when the object is unbounded
+    virtual bool get_bounding_sphere(Point3D &center, double &radius)
+    {
+        return false;
+    }
+    
+    virtual bool get_bounding_box(Point3D &min_corner, Point3D &max_corner)
+    {
+        Point3D center;
+        double radius;
+        
+        if(!get_bounding_sphere(center, radius)) return false;
+        
+        min_corner = center - Point3D(radius, radius, radius);
+        max_corner = center + Point3D(radius, radius, radius);
+        return true;
+    }
+    
+    // false when no ray from point (on the surface) towards a light within extent of light_center can hit the object again
+    virtual bool may_shadow_itself(const Point3D &point, const Point3D &light_center, double extent) const
+    {
+        return true;
+    }
+    
+    virtual void print_object()
+    {
+
+    }
+
+    virtual ~Object()
+    {
+        reference_point = Point3D();
+        color.clear();
+        reflection_coefficients.clear();
+        height = width = length = 0.0;
+        shininess = 0;
+    }
+};
+
+vector<Object*> objects;
+vector<Light> lights;
+int level_of_recursion;
+
+/*
+ Reflection rays can be stopped before level_of_recursion once their possible contribution is invisible.
+ The contribution of a reflection ray is at most (product of reflection coefficients) * max_radiance_bound.
+ TERMINATE_THRESHOLD drops it below reflection_contribution_threshold, TERMINATE_RUSSIAN_ROULETTE
+ keeps it with probability contribution / threshold and scales the survivors up so the image stays unbiased.
+ */
+enum ReflectionTermination { TERMINATE_NONE, TERMINATE_THRESHOLD, TERMINATE_RUSSIAN_ROULETTE };
+
+int reflection_termination_mode = TERMINATE_NONE;
+double reflection_contribution_threshold = 0.5 / 255; // half of one 8-bit step
+double max_radiance_bound = numeric_limits<double>::max();
+
+int num_of_worker_threads = 0; // 0 uses every hardware thread
+
+int get_num_of_worker_threads()
+{
+    if(num_of_worker_threads > 0) return num_of_worker_threads;
+    
+    return max(1, (int) thread::hardware_concurrency());
+}
+
+/*
+ NUMA placement (--numa). Worker i of n is pinned to node i * nodes / n, so the contiguous shares of
+ neighbouring workers stay on one node, and buffers a worker allocates are first touched on its node.
+ Pinning uses the processor group API on Windows, and on Linux sched_setaffinity() with the CPUs that
+ /sys/devices/system/node lists for the node. macOS has no NUMA and no pinning, so it is a no-op there.
+ */
+bool numa_rendering = false;
+int numa_active_nodes = 0; // nodes the workers are spread over, 0 uses all of them
+
+thread_local int current_numa_node = 0;
+thread_local int current_worker_id = 0; // of the parallel_for_dynamic() call the thread works for
+
+// cancel flag of the background job (capture or preview) the thread renders for, nullptr when it cannot be
+// cancelled. parallel_for() and parallel_for_dynamic() hand it on to their workers
+thread_local const atomic<bool> *render_cancel_flag = nullptr;
+
+bool is_render_cancelled()
+{
+    return render_cancel_flag != nullptr && *render_cancel_flag;
+}
+
+int get_num_of_numa_nodes()
+{
+#ifdef _WIN32
+    ULONG highest_node = 0;
+    if(GetNumaHighestNodeNumber(&highest_node)) return (int) highest_node + 1;
+#elif defined(__linux__)
+    int num_of_nodes = 0;
+    char path[64];
+    
+    for(;; num_of_nodes++)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", num_of_nodes);
+        if(access(path, F_OK) != 0) break;
+    }
+    if(num_of_nodes > 0) return num_of_nodes;
+#endif
+    return 1;
+}
+
+#ifdef __linux__
+// the CPUs of a node, from its cpulist ("0-7,16-23"), false when the node is unknown
+bool get_numa_node_cpus(int node, cpu_set_t &cpus)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    
+    FILE *cpulist = fopen(path, "r");
+    if(cpulist == nullptr) return false;
+    
+    int first, last, count = 0;
+    CPU_ZERO(&cpus);
+    
+    while(fscanf(cpulist, "%d", &first) == 1)
+    {
+        last = first;
+        if(fscanf(cpulist, "-%d", &last) != 1) last = first;
+        
+        for(int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++, count++) CPU_SET(cpu, &cpus);
+        if(fgetc(cpulist) != ',') break;
+    }
+    fclose(cpulist);
+    return count > 0;
+}
+#endif
+
+int get_num_of_active_numa_nodes()
+{
+    int num_of_nodes = get_num_of_numa_nodes();
+    
+    return numa_active_nodes > 0 ? min(numa_active_nodes, num_of_nodes) : num_of_nodes;
+}
+
+// pins the calling thread to a NUMA node while it lives, the previous affinity is restored afterwards
+class NumaPin{
+
+#ifdef _WIN32
+    GROUP_AFFINITY previous_affinity;
+#elif defined(__linux__)
+    cpu_set_t previous_affinity;
+#endif
+    bool is_pinned;
+    int previous_node;
+
+public:
+    explicit NumaPin(int node)
+    {
+        is_pinned = false;
+        previous_node = current_numa_node;
+        
+        if(!numa_rendering) return;
+        
+        current_numa_node = node;
+#ifdef _WIN32
+        GROUP_AFFINITY affinity;
+        
+        if(GetNumaNodeProcessorMaskEx((USHORT) node, &affinity))
+        {
+            is_pinned = SetThreadGroupAffinity(GetCurrentThread(), &affinity, &previous_affinity) != 0;
+        }
+#elif defined(__linux__)
+        cpu_set_t affinity;
+        
+        if(get_numa_node_cpus(node, affinity) && sched_getaffinity(0, sizeof(previous_affinity), &previous_affinity) == 0)
+        {
+            is_pinned = sched_setaffinity(0, sizeof(affinity), &affinity) == 0;
+        }
+#endif
+    }
+    
+    NumaPin(int worker, int num_of_workers) : NumaPin(worker * get_num_of_active_numa_nodes() / max(1, num_of_workers)) {}
+    
+    ~NumaPin()
+    {
+        current_numa_node = previous_node;
+#ifdef _WIN32
+        if(is_pinned) SetThreadGroupAffinity(GetCurrentThread(), &previous_affinity, nullptr);
+#elif defined(__linux__)
+        if(is_pinned) sched_setaffinity(0, sizeof(previous_affinity), &previous_affinity);
+#endif
+    }
+};
+
+// Runs body(begin, end) over [0, n) split into one contiguous chunk per worker thread
+template<typename Body>
+void parallel_for(int n, const Body &body)
+{
+    int num_of_threads = get_num_of_worker_threads();
+    num_of_threads = min(num_of_threads, max(1, n));
+    
+    if(num_of_threads == 1)
+    {
+        body(0, n);
+        return;
+    }
+    
+    vector<thread> workers;
+    int chunk = (n + num_of_threads - 1) / num_of_threads;
+    const atomic<bool> *cancel_flag = render_cancel_flag;
+    
+    for(int i = 0; i < num_of_threads; i++)
+    {
+        int begin = i * chunk;
+        int end = min(n, begin + chunk);
+        
+        if(begin >= end) break;
+        workers.emplace_back([&body, begin, end, i, num_of_threads, cancel_flag]() {
+            NumaPin pin(i, num_of_threads);
+            render_cancel_flag = cancel_flag;
+            body(begin, end);
+        });
+    }
+    
+    for(int i = 0; i < (int) workers.size(); i++)
+    {
+        workers[i].join();
+    }
+}
+
+/*
+ Work stealing for uneven work like pixels, where a tile of sky costs nothing and a tile of reflective
+ spheres costs a lot. Every worker starts with one contiguous share of [0, n) and runs it grain items at
+ a time. A worker whose chunk took longer than SCHEDULER_SPLIT_SECONDS halves its grain, so expensive
+ regions are cut into smaller pieces. A worker that runs out steals the upper half of what is left of
+ the busiest worker, so all of them finish at about the same time.
+ */
+#define SCHEDULER_SPLIT_SECONDS 0.002
+#define SCHEDULER_MIN_GRAIN 16
+
+struct WorkerRange{
+    mutex lock;
+    int next, end; // items not taken yet
+};
+
+template<typename Body>
+void parallel_for_dynamic(int n, int grain, const Body &body)
+{
+    int num_of_threads = get_num_of_worker_threads();
+    num_of_threads = min(num_of_threads, max(1, (n + grain - 1) / max(1, grain)));
+    
+    if(num_of_threads <= 1)
+    {
+        current_worker_id = 0;
+        body(0, n);
+        return;
+    }
+    
+    vector<WorkerRange> ranges(num_of_threads);
+    int share = (n + num_of_threads - 1) / num_of_threads;
+    
+    for(int i = 0; i < num_of_threads; i++)
+    {
+        ranges[i].next = min(n, i * share);
+        ranges[i].end = min(n, (i + 1) * share);
+    }
+    
+    const atomic<bool> *cancel_flag = render_cancel_flag;
+    
+    auto work = [&](int id) {
+        NumaPin pin(id, num_of_threads);
+        WorkerRange &own = ranges[id];
+        int current_grain = max(1, grain);
+        current_worker_id = id;
+        render_cancel_flag = cancel_flag;
+        
+        while(true)
+        {
+            int begin, end;
+            {
+                lock_guard<mutex> guard(own.lock);
+                begin = own.next;
+                end = min(own.end, begin + current_grain);
+                own.next = end;
+            }
+            
+            if(begin < end)
+            {
+                chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+                body(begin, end);
+                
+                if(current_grain > SCHEDULER_MIN_GRAIN && chrono::duration<double>(chrono::steady_clock::now() - start_time).count() > SCHEDULER_SPLIT_SECONDS)
+                {
+                    current_grain = max(SCHEDULER_MIN_GRAIN, current_grain / 2);
+                }
+                continue;
+            }
+            
+            // own range is empty, steal the upper half of the largest remaining one, from a worker of the same node if possible
+            int victim = -1, most_left = 0;
+            int num_of_nodes = numa_rendering ? get_num_of_active_numa_nodes() : 1;
+            int own_node = id * num_of_nodes / num_of_threads;
+            
+            for(int pass = 0; pass < 2 && victim == -1; pass++)
+            {
+                for(int i = 0; i < num_of_threads; i++)
+                {
+                    if(pass == 0 && i * num_of_nodes / num_of_threads != own_node) continue;
+                    
+                    lock_guard<mutex> guard(ranges[i].lock);
+                    int left = ranges[i].end - ranges[i].next;
+                    
+                    if(left > most_left)
+                    {
+                        most_left = left;
+                        victim = i;
+                    }
+                }
+            }
+            if(victim == -1) return; // nothing left anywhere
+            
+            int stolen_begin, stolen_end;
+            {
+                lock_guard<mutex> guard(ranges[victim].lock);
+                int left = ranges[victim].end - ranges[victim].next;
+                
+                if(left <= 0) continue;
+                
+                stolen_end = ranges[victim].end;
+                stolen_begin = left > SCHEDULER_MIN_GRAIN ? ranges[victim].next + left / 2 : ranges[victim].next;
+                ranges[victim].end = stolen_begin;
+            }
+            {
+                lock_guard<mutex> guard(own.lock);
+                own.next = stolen_begin;
+                own.end = stolen_end;
+            }
+        }
+    };
+    
+    vector<thread> workers;
+    for(int i = 1; i < num_of_threads; i++)
+    {
+        workers.emplace_back(work, i);
+    }
+    work(0);
+    
+    for(int i = 0; i < (int) workers.size(); i++)
+    {
+        workers[i].join();
+    }
+}
+
+double get_random_number()
+{
+    thread_local mt19937 random_engine(5489u);
+    thread_local uniform_real_distribution<double> distribution(0.0, 1.0);
+    
+    return distribution(random_engine);
+}
+
+/*
+ Sample generator for every stochastic decision (pixel jitter, light picks, russian roulette). A sample is
+ addressed by (pixel, sample index, dimension), so its value does not depend on which thread traces the pixel:
+   SAMPLER_SOBOL      2D Sobol points per pair of dimensions, index and digits scrambled by a hash of the pixel
+   SAMPLER_HALTON     radical inverse in the prime base of the dimension, shifted by a hash of the pixel
+   SAMPLER_BLUE_NOISE BLUE_NOISE_TILE_SIZE^2 void-and-cluster tile, shifted per dimension, golden ratio steps per index
+   SAMPLER_RANDOM     get_random_number(), not reproducible across thread counts
+ Dimensions are consumed in order along a path with get_next_sample() after start_pixel_sample().
+ */
+enum SamplerType { SAMPLER_RANDOM, SAMPLER_HALTON, SAMPLER_SOBOL, SAMPLER_BLUE_NOISE, NUM_OF_SAMPLERS };
+
+#define BLUE_NOISE_TILE_SIZE 64
+
+int sampler_type = SAMPLER_SOBOL;
+
+struct SampleState{
+    unsigned int pixel_x, pixel_y;
+    unsigned int sample_index;
+    unsigned int dimension; // next dimension get_next_sample() returns
+};
+
+thread_local SampleState sample_state = {0, 0, 0, 0};
+
+unsigned int hash_sample_key(unsigned int a, unsigned int b, unsigned int c)
+{
+    unsigned int h = a * 0x9e3779b9u ^ (b + 0x7f4a7c15u) * 0x85ebca6bu ^ (c + 0x165667b1u) * 0xc2b2ae35u;
+    
+    // murmur3 finalizer
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// [0, 1) from the 32 bits of a fixed point fraction
+double get_unit_fraction(unsigned int bits)
+{
+    return bits * (1.0 / 4294967296.0);
+}
+
+double radical_inverse(unsigned int base, unsigned int index)
+{
+    double inverse_base = 1.0 / base, digit_weight = inverse_base, result = 0.0;
+    
+    for(; index > 0; index /= base)
+    {
+        result += (index % base) * digit_weight;
+        digit_weight *= inverse_base;
+    }
+    return result;
+}
+
+// both dimensions of the 2D Sobol sequence, the first one is van der Corput
+unsigned int sobol_sample_bits(unsigned int index, int dimension)
+{
+    unsigned int result = 0;
+    
+    for(unsigned int v = 1u << 31; index > 0; index >>= 1, v = dimension == 0 ? v >> 1 : v ^ (v >> 1))
+    {
+        if(index & 1) result ^= v;
+    }
+    return result;
+}
+
+// ranks of a void-and-cluster tile divided by its size, so the values are uniform in [0, 1)
+const vector<double> &get_blue_noise_tile()
+{
+    static const vector<double> tile = []() {
+        const int n = BLUE_NOISE_TILE_SIZE, num_of_cells = n * n;
+        const double sigma = 1.5;
+        vector<double> kernel(num_of_cells), energy(num_of_cells, 0.0), values(num_of_cells, -1.0);
+        
+        // toroidal gaussian energy one point adds to every cell
+        for(int y = 0; y < n; y++)
+        {
+            for(int x = 0; x < n; x++)
+            {
+                int dx = min(x, n - x), dy = min(y, n - y);
+                kernel[y * n + x] = exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+            }
+        }
+        
+        // the largest void (lowest energy free cell) receives the next rank
+        for(int rank = 0; rank < num_of_cells; rank++)
+        {
+            int best = -1;
+            for(int c = 0; c < num_of_cells; c++)
+            {
+                if(values[c] < 0.0 && (best == -1 || energy[c] < energy[best])) best = c;
+            }
+            
+            values[best] = (rank + 0.5) / num_of_cells;
+            
+            int best_x = best % n, best_y = best / n;
+            for(int y = 0; y < n; y++)
+            {
+                for(int x = 0; x < n; x++)
+                {
+                    energy[y * n + x] += kernel[((y - best_y + n) % n) * n + (x - best_x + n) % n];
+                }
+            }
+        }
+        return values;
+    }();
+    
+    return tile;
+}
+
+double get_sample(unsigned int pixel_x, unsigned int pixel_y, unsigned int sample_index, unsigned int dimension)
+{
+    static const unsigned int primes[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53};
+    const int num_of_primes = sizeof(primes) / sizeof(primes[0]);
+    
+    switch(sampler_type)
+    {
+        case SAMPLER_SOBOL:
+        {
+            // the first 2^k indices of any scramble still form one stratified block of the sequence
+            unsigned int pair_key = hash_sample_key(pixel_x, pixel_y, dimension / 2);
+            unsigned int bits = sobol_sample_bits(sample_index ^ pair_key, dimension % 2);
+            
+            return get_unit_fraction(bits ^ hash_sample_key(pair_key, dimension, 0x2545f491u));
+        }
+        case SAMPLER_HALTON:
+        {
+            double shift = get_unit_fraction(hash_sample_key(pixel_x, pixel_y, dimension));
+            double value = radical_inverse(primes[dimension % num_of_primes], sample_index + 1) + shift;
+            
+            return value - floor(value);
+        }
+        case SAMPLER_BLUE_NOISE:
+        {
+            const vector<double> &tile = get_blue_noise_tile();
+            unsigned int shift = hash_sample_key(dimension, 0x68e31da4u, 0xb5297a4du);
+            unsigned int x = (pixel_x + shift) % BLUE_NOISE_TILE_SIZE;
+            unsigned int y = (pixel_y + (shift >> 16)) % BLUE_NOISE_TILE_SIZE;
+            double value = tile[y * BLUE_NOISE_TILE_SIZE + x] + sample_index * 0.6180339887498949;
+            
+            return value - floor(value);
+        }
+        default:
+            return get_random_number();
+    }
+}
+
+// sets the sample the following get_next_sample() calls of this thread belong to
+void start_pixel_sample(unsigned int pixel_x, unsigned int pixel_y, unsigned int sample_index)
+{
+    sample_state.pixel_x = pixel_x;
+    sample_state.pixel_y = pixel_y;
+    sample_state.sample_index = sample_index;
+    sample_state.dimension = 0;
+}
+
+double get_next_sample()
+{
+    return get_sample(sample_state.pixel_x, sample_state.pixel_y, sample_state.sample_index, sample_state.dimension++);
+}
+
+const char *get_sampler_name()
+{
+    const char *names[NUM_OF_SAMPLERS] = {"random", "halton", "sobol", "blue noise"};
+    
+    return names[sampler_type];
+}
+
+// returns the index of the nearest object hit by the ray or -1, t_min receives its t value
+int find_nearest_object(const Ray &ray, double &t_min)
+{
+    int nearest = -1;
+    double t;
+    thread_local vector<double> dummy_color(3); // not written at level 0, kept per thread to skip an allocation per ray
+    t_min = numeric_limits<double>::max();
+    
+    for(int k = 0; k < (int) objects.size(); k++)
+    {
+        t = objects[k]->intersect(ray, dummy_color, 0);
+        
+        if(t < t_min && t > 0)
+        {
+            t_min = t;
+            nearest = k;
+        }
+    }
+    return nearest;
+}
+
+Ray get_light_ray(const Light &light, const Point3D &intersection_point)
+{
+    /* Construct L ray like in the picture. direction = (lightSource - intersectionPoint) then normalize it */
+    Point3D light_ray_direction = light.source_light_position - intersection_point;
+    light_ray_direction.normalize_point();
+    
+    Point3D light_ray_start = intersection_point +  0.001 * light_ray_direction;// 0.001 is for taking slightly above the point so it doesn’t again intersect with same object due to precision
+    
+    return Ray(light_ray_start, light_ray_direction);
+}
+
+/*
+ Candidate occluders of one light. Directions leaving the light are split into the cells of a cube map,
+ and every cell lists the objects whose bounding sphere overlaps its cone, sorted by their nearest distance
+ to the light. A shadow ray only tests the list of the cell it passes through, and stops at the first
+ object that starts farther away than the intersection point. For an area light the bounding spheres are
+ grown by the extent of the light, so the cell of the direction from its center also holds every object
+ that can block a ray from another point of the light.
+ */
+#define pi_value (2 * acos(0.0))
+#define OCCLUDER_GRID_RESOLUTION 16 // cells along one edge of a cube face
+#define OCCLUDER_GRID_CELLS (6 * OCCLUDER_GRID_RESOLUTION * OCCLUDER_GRID_RESOLUTION)
+
+struct LightOccluderGrid{
+    PagedArray<int> cell_start; // objects of cell c are cell_objects[cell_start[c] .. cell_start[c + 1])
+    PagedArray<int> cell_objects;
+    PagedArray<double> cell_near_distances;
+    
+    // cone around every object as seen from the light, a half angle of pi when it can block any direction
+    PagedArray<Point3D> object_axes;
+    PagedArray<double> object_half_angles;
+    PagedArray<double> object_cos_half_angles, object_sin_half_angles;
+    
+    template<typename Step>
+    void for_each_array(PageFile &file, const Step &step)
+    {
+        step(cell_start, file);
+        step(cell_objects, file);
+        step(cell_near_distances, file);
+        step(object_axes, file);
+        step(object_half_angles, file);
+        step(object_cos_half_angles, file);
+        step(object_sin_half_angles, file);
+    }
+};
+
+vector<LightOccluderGrid> light_occluder_grids; // one per light, rebuilt by build_light_occluder_grids()
+vector<vector<LightOccluderGrid> > occluder_grid_replicas; // copies for NUMA nodes 1, 2, ... made by threads on those nodes
+
+// the grids of the node the calling thread runs on
+const vector<LightOccluderGrid> &get_light_occluder_grids()
+{
+    if(current_numa_node > 0 && current_numa_node <= (int) occluder_grid_replicas.size()) return occluder_grid_replicas[current_numa_node - 1];
+    
+    return light_occluder_grids;
+}
+
+// bounds of every object, shared by the grids of all lights
+struct OccluderBounds{
+    bool has_sphere, has_box;
+    Point3D center;
+    double radius; // with the margin for shadow ray starts
+    Point3D min_corner, max_corner;
+};
+
+vector<OccluderBounds> occluder_bounds;
+
+int get_occluder_grid_cell(const Point3D &direction)
+{
+    double ax = fabs(direction.x), ay = fabs(direction.y), az = fabs(direction.z);
+    int face;
+    double u, v;
+    
+    if(ax >= ay && ax >= az)
+    {
+        face = direction.x > 0 ? 0 : 1;
+        u = direction.y / ax;
+        v = direction.z / ax;
+    }
+    else if(ay >= az)
+    {
+        face = direction.y > 0 ? 2 : 3;
+        u = direction.x / ay;
+        v = direction.z / ay;
+    }
+    else
+    {
+        face = direction.z > 0 ? 4 : 5;
+        u = direction.x / az;
+        v = direction.y / az;
+    }
+    
+    int cell_u = min(OCCLUDER_GRID_RESOLUTION - 1, (int) ((u + 1.0) * 0.5 * OCCLUDER_GRID_RESOLUTION));
+    int cell_v = min(OCCLUDER_GRID_RESOLUTION - 1, (int) ((v + 1.0) * 0.5 * OCCLUDER_GRID_RESOLUTION));
+    
+    return (face * OCCLUDER_GRID_RESOLUTION + cell_u) * OCCLUDER_GRID_RESOLUTION + cell_v;
+}
+
+// center direction of a cell and the angle from it to the farthest corner of the cell
+void get_occluder_grid_cell_cone(int cell, Point3D &axis, double &half_angle)
+{
+    int face = cell / (OCCLUDER_GRID_RESOLUTION * OCCLUDER_GRID_RESOLUTION);
+    int cell_u = (cell / OCCLUDER_GRID_RESOLUTION) % OCCLUDER_GRID_RESOLUTION;
+    int cell_v = cell % OCCLUDER_GRID_RESOLUTION;
+    double sign = face % 2 == 0 ? 1.0 : -1.0;
+    
+    Point3D corners[5];
+    double us[5] = {cell_u + 0.5, (double) cell_u, cell_u + 1.0, (double) cell_u, cell_u + 1.0};
+    double vs[5] = {cell_v + 0.5, (double) cell_v, (double) cell_v, cell_v + 1.0, cell_v + 1.0};
+    
+    for(int i = 0; i < 5; i++)
+    {
+        double u = us[i] * 2.0 / OCCLUDER_GRID_RESOLUTION - 1.0;
+        double v = vs[i] * 2.0 / OCCLUDER_GRID_RESOLUTION - 1.0;
+        
+        if(face < 2) corners[i] = Point3D(sign, u, v);
+        else if(face < 4) corners[i] = Point3D(u, sign, v);
+        else corners[i] = Point3D(u, v, sign);
+        corners[i].normalize_point();
+    }
+    
+    axis = corners[0];
+    half_angle = 0.0;
+    for(int i = 1; i < 5; i++)
+    {
+        half_angle = max(half_angle, acos(min(1.0, vector_dot_product(axis, corners[i]))));
+    }
+}
+
+// call once per frame after objects or lights change
+void build_light_occluder_grids()
+{
+    vector<Point3D> cell_axes(OCCLUDER_GRID_CELLS);
+    vector<double> cell_half_angles(OCCLUDER_GRID_CELLS);
+    
+    for(int c = 0; c < OCCLUDER_GRID_CELLS; c++)
+    {
+        get_occluder_grid_cell_cone(c, cell_axes[c], cell_half_angles[c]);
+    }
+    
+    vector<Point3D> centers(objects.size());
+    vector<double> radii(objects.size());
+    vector<char> is_bounded(objects.size());
+    
+    occluder_bounds.resize(objects.size());
+    
+    for(int j = 0; j < (int) objects.size(); j++)
+    {
+        is_bounded[j] = objects[j]->get_bounding_sphere(centers[j], radii[j]);
+        radii[j] += 0.01; // shadow rays start 0.001 off the surface, keep a margin around every object
+        
+        OccluderBounds &bounds = occluder_bounds[j];
+        bounds.has_sphere = is_bounded[j];
+        bounds.center = centers[j];
+        bounds.radius = radii[j];
+        bounds.has_box = objects[j]->get_bounding_box(bounds.min_corner, bounds.max_corner);
+    }
+    
+    light_occluder_grids.resize(lights.size());
+    
+    for(int i = 0; i < (int) lights.size(); i++)
+    {
+        const Point3D &light_position = lights[i].source_light_position;
+        double light_extent = lights[i].get_extent();
+        vector<vector<pair<double, int> > > cells(OCCLUDER_GRID_CELLS);
+        LightOccluderGrid &grid = light_occluder_grids[i];
+        
+        grid.object_axes.assign(objects.size(), Point3D(0, 0, 1));
+        grid.object_half_angles.assign(objects.size(), pi_value);
+        grid.object_cos_half_angles.assign(objects.size(), -1.0);
+        grid.object_sin_half_angles.assign(objects.size(), 0.0);
+        
+        for(int j = 0; j < (int) objects.size(); j++)
+        {
+            double distance = is_bounded[j] ? distance_between_points(light_position, centers[j]) : 0.0;
+            double radius = radii[j] + light_extent;
+            
+            if(!is_bounded[j] || distance <= radius) // light inside or object unbounded, it can block any direction
+            {
+                for(int c = 0; c < OCCLUDER_GRID_CELLS; c++) cells[c].push_back(make_pair(0.0, j));
+                continue;
+            }
+            
+            Point3D axis = (centers[j] - light_position) * (1.0 / distance);
+            double half_angle = asin(radius / distance);
+            
+            grid.object_axes[j] = axis;
+            grid.object_half_angles[j] = half_angle;
+            grid.object_cos_half_angles[j] = cos(half_angle);
+            grid.object_sin_half_angles[j] = sin(half_angle);
+            
+            for(int c = 0; c < OCCLUDER_GRID_CELLS; c++)
+            {
+                double angle = acos(max(-1.0, min(1.0, vector_dot_product(axis, cell_axes[c]))));
+                
+                if(angle <= half_angle + cell_half_angles[c] + epsilon) cells[c].push_back(make_pair(distance - radius, j));
+            }
+        }
+        
+        grid.cell_start.assign(1, 0);
+        grid.cell_objects.clear();
+        grid.cell_near_distances.clear();
+        
+        for(int c = 0; c < OCCLUDER_GRID_CELLS; c++)
+        {
+            sort(cells[c].begin(), cells[c].end());
+            for(int k = 0; k < (int) cells[c].size(); k++)
+            {
+                grid.cell_near_distances.push_back(cells[c][k].first);
+                grid.cell_objects.push_back(cells[c][k].second);
+            }
+            grid.cell_start.push_back((int) grid.cell_objects.size());
+        }
+    }
+    
+    if(out_of_core_rendering)
+    {
+        occluder_page_file.reset();
+        for(int i = 0; i < (int) light_occluder_grids.size(); i++)
+        {
+            light_occluder_grids[i].for_each_array(occluder_page_file, [](auto &array, PageFile &file) { array.page_out(file); });
+        }
+        if(occluder_page_file.map())
+        {
+            for(int i = 0; i < (int) light_occluder_grids.size(); i++)
+            {
+                light_occluder_grids[i].for_each_array(occluder_page_file, [](auto &array, PageFile &file) { array.attach(file); });
+            }
+        }
+    }
+    
+    // read only from here on, every other node gets its own copy (paged grids share the mapping instead)
+    int num_of_nodes = numa_rendering && !out_of_core_rendering ? get_num_of_active_numa_nodes() : 1;
+    occluder_grid_replicas.assign(num_of_nodes - 1, vector<LightOccluderGrid>());
+    
+    vector<thread> copiers;
+    for(int node = 1; node < num_of_nodes; node++)
+    {
+        copiers.emplace_back([node]() {
+            NumaPin pin(node);
+            occluder_grid_replicas[node - 1] = light_occluder_grids;
+        });
+    }
+    for(int k = 0; k < (int) copiers.size(); k++)
+    {
+        copiers[k].join();
+    }
+}
+
+// tests light_ray against the objects of one grid cell, the ones starting farther than near_limit from the light center are skipped
+bool is_light_ray_obscured_in_cell(int light_index, int cell, const Ray &light_ray, double dist_from_light_to_intersection, double near_limit)
+{
+    const vector<LightOccluderGrid> &grids = get_light_occluder_grids();
+    
+    if(light_index < (int) grids.size())
+    {
+        const LightOccluderGrid &grid = grids[light_index];
+        
+        for(int k = grid.cell_start[cell]; k < grid.cell_start[cell + 1]; k++)
+        {
+            if(grid.cell_near_distances[k] > near_limit) break; // every later object is behind the point
+            
+            double t_value = objects[grid.cell_objects[k]]->get_intersection_point_t_value(light_ray);
+            
+            if(t_value > 0.0 && t_value <= dist_from_light_to_intersection)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // For each object now check whether this L ray obscured by any object or not.
+    for(int j = 0; j < (int) objects.size(); j++)
+    {
+        double t_value = objects[j]->get_intersection_point_t_value(light_ray);
+        
+        if(t_value > 0.0 && t_value <= dist_from_light_to_intersection)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool is_light_ray_obscured(int light_index, const Ray &light_ray, double dist_from_light_to_intersection)
+{
+    int cell = get_occluder_grid_cell((-1) * light_ray.direction); // direction from the light towards the point
+    
+    return is_light_ray_obscured_in_cell(light_index, cell, light_ray, dist_from_light_to_intersection, dist_from_light_to_intersection);
+}
+
+/*
+ Soft shadows of area lights. The visible fraction of the light is estimated per shading point:
+ AREA_LIGHT_PROBE_SAMPLES shadow rays to points of the light first, and only when some of them are
+ blocked and some are not (penumbra) up to AREA_LIGHT_MAX_SAMPLES in total. Before any ray is traced
+ the candidates of the grid cell are checked against the segment from the light center to the point,
+ grown by the light extent. When none can reach it the point is fully lit without a shadow ray.
+ */
+#define AREA_LIGHT_PROBE_SAMPLES 4
+#define AREA_LIGHT_MAX_SAMPLES 16
+
+// distance from point to the segment from a to b
+double distance_to_segment(const Point3D &point, const Point3D &a, const Point3D &b)
+{
+    Point3D ab = b - a;
+    double length_square = vector_dot_product(ab, ab);
+    double s = length_square > 0.0 ? vector_dot_product(point - a, ab) / length_square : 0.0;
+    
+    s = max(0.0, min(1.0, s));
+    return distance_between_points(point, a + ab * s);
+}
+
+// slab test of the segment from a to b against the box grown by margin
+bool does_segment_touch_box(const Point3D &a, const Point3D &b, const Point3D &min_corner, const Point3D &max_corner, double margin)
+{
+    double start[3] = {a.x, a.y, a.z}, delta[3] = {b.x - a.x, b.y - a.y, b.z - a.z};
+    double low[3] = {min_corner.x - margin, min_corner.y - margin, min_corner.z - margin};
+    double high[3] = {max_corner.x + margin, max_corner.y + margin, max_corner.z + margin};
+    double s_enter = 0.0, s_exit = 1.0;
+    
+    for(int axis = 0; axis < 3; axis++)
+    {
+        if(fabs(delta[axis]) < epsilon)
+        {
+            if(start[axis] < low[axis] || start[axis] > high[axis]) return false;
+            continue;
+        }
+        
+        double s1 = (low[axis] - start[axis]) / delta[axis], s2 = (high[axis] - start[axis]) / delta[axis];
+        s_enter = max(s_enter, min(s1, s2));
+        s_exit = min(s_exit, max(s1, s2));
+        
+        if(s_enter > s_exit) return false;
+    }
+    return true;
+}
+
+// true when some object may block a ray from point to the area light, surface is the object point lies on
+bool has_area_light_occluder(int light_index, int cell, const Point3D &point, double distance, const Object *surface)
+{
+    const Light &light = lights[light_index];
+    double extent = light.get_extent();
+    const vector<LightOccluderGrid> &grids = get_light_occluder_grids();
+    bool has_grid = light_index < (int) grids.size();
+    int begin = has_grid ? grids[light_index].cell_start[cell] : 0;
+    int end = has_grid ? grids[light_index].cell_start[cell + 1] : (int) objects.size();
+    
+    for(int k = begin; k < end; k++)
+    {
+        if(has_grid && grids[light_index].cell_near_distances[k] > distance) break;
+        
+        int j = has_grid ? grids[light_index].cell_objects[k] : k;
+        if(objects[j] == surface && !surface->may_shadow_itself(point, light.source_light_position, extent)) continue;
+        
+        const OccluderBounds &bounds = occluder_bounds[j];
+        
+        if(bounds.has_sphere && distance_to_segment(bounds.center, light.source_light_position, point) > bounds.radius + extent) continue;
+        if(bounds.has_box && !does_segment_touch_box(light.source_light_position, point, bounds.min_corner, bounds.max_corner, extent + 0.01)) continue;
+        
+        return true;
+    }
+    return false;
+}
+
+// fraction of light light_index that is visible from point (0 or 1 for a point light), surface is the object point lies on
+double get_light_visibility(int light_index, const Point3D &point, const Object *surface)
+{
+    const Light &light = lights[light_index];
+    double distance = distance_between_points(light.source_light_position, point);
+    
+    if(!light.is_area_light())
+    {
+        return is_light_ray_obscured(light_index, get_light_ray(light, point), distance) ? 0.0 : 1.0;
+    }
+    
+    int cell = get_occluder_grid_cell(point - light.source_light_position);
+    
+    if(occluder_bounds.size() == objects.size() && !has_area_light_occluder(light_index, cell, point, distance, surface)) return 1.0;
+    
+    int num_of_samples = 0, num_of_visible = 0;
+    
+    for(; num_of_samples < AREA_LIGHT_MAX_SAMPLES; num_of_samples++)
+    {
+        if(num_of_samples == AREA_LIGHT_PROBE_SAMPLES && (num_of_visible == 0 || num_of_visible == num_of_samples)) break; // not in penumbra
+        
+        double u1 = get_next_sample();
+        Point3D light_point = light.get_sample_position(point, u1, get_next_sample());
+        Point3D direction = light_point - point;
+        double sample_distance = sqrt(vector_dot_product(direction, direction));
+        direction.normalize_point();
+        
+        Ray light_ray(point + 0.001 * direction, direction);
+        
+        if(!is_light_ray_obscured_in_cell(light_index, cell, light_ray, sample_distance, max(distance, light.get_extent()))) num_of_visible++;
+    }
+    return (double) num_of_visible / num_of_samples;
+}
+
+// Sets occluded[k] for the lanes of a packet towards light light_index. All lanes start in the same grid cell.
+void trace_shadow_packet(int light_index, const ShadowRayPacket &packet, int cell, char occluded[])
+{
+    // cone from the light that contains every lane, objects outside of it are skipped for the whole packet
+    Point3D axis;
+    double max_distance = 0.0;
+    for(int k = 0; k < packet.size; k++)
+    {
+        axis = axis - Point3D(packet.direction_x[k], packet.direction_y[k], packet.direction_z[k]);
+        max_distance = max(max_distance, packet.distance[k]);
+    }
+    axis.normalize_point();
+    
+    double half_angle = 0.0;
+    for(int k = 0; k < packet.size; k++)
+    {
+        Point3D direction(-packet.direction_x[k], -packet.direction_y[k], -packet.direction_z[k]);
+        half_angle = max(half_angle, acos(max(-1.0, min(1.0, vector_dot_product(axis, direction)))));
+    }
+    
+    double cos_half_angle = cos(half_angle), sin_half_angle = sin(half_angle);
+    const vector<LightOccluderGrid> &grids = get_light_occluder_grids();
+    bool has_grid = light_index < (int) grids.size();
+    int begin = 0, end = (int) objects.size();
+    
+    if(has_grid)
+    {
+        begin = grids[light_index].cell_start[cell];
+        end = grids[light_index].cell_start[cell + 1];
+    }
+    
+    for(int k = begin; k < end; k++)
+    {
+        int j = k;
+        
+        if(has_grid)
+        {
+            const LightOccluderGrid &grid = grids[light_index];
+            
+            if(grid.cell_near_distances[k] > max_distance) break;
+            
+            j = grid.cell_objects[k];
+            
+            // the cones are disjoint when the angle between the axes exceeds the sum of the half angles
+            if(half_angle + grid.object_half_angles[j] < pi_value)
+            {
+                double cos_sum = cos_half_angle * grid.object_cos_half_angles[j] - sin_half_angle * grid.object_sin_half_angles[j];
+                
+                if(vector_dot_product(axis, grid.object_axes[j]) < cos_sum - epsilon) continue;
+            }
+        }
+        
+        objects[j]->occlude_packet(packet, occluded);
+        
+        bool all_occluded = true;
+        for(int lane = 0; lane < packet.size; lane++)
+        {
+            all_occluded = all_occluded && occluded[lane];
+        }
+        if(all_occluded) return;
+    }
+}
+
+/*
+ Clustered light lists. The scene bounds are split into a uniform grid and every cell lists the lights
+ whose influence sphere reaches it (lights without a radius are in every list), so shading a point only
+ loops over the lights that can affect it. Only built when some light has an influence radius, or when
+ lights are sampled, which weights them per cell by their distance to it.
+ */
+#define LIGHT_CLUSTER_RESOLUTION 32 // cells along the longest side of the scene bounds
+#define LIGHT_SAMPLING_RESOLUTION 8 // coarser grid when the cells only hold sampling weights
+
+struct LightClusterGrid{
+    bool is_built;
+    Point3D min_corner;
+    double cell_size;
+    int num_of_cells[3];
+    vector<int> cell_start; // lights of cell c are cell_lights[cell_start[c] .. cell_start[c + 1])
+    vector<int> cell_lights;
+    vector<int> outside_lights; // lights without a radius or whose influence reaches past the grid
+    int max_lights_per_point;
+};
+
+LightClusterGrid light_clusters;
+vector<int> all_light_indices; // used when the grid is not built
+
+int light_samples_per_point = 0; // 0 shades with every light
+
+// call once per frame after objects or lights change
+void build_light_clusters()
+{
+    all_light_indices.resize(lights.size());
+    for(int i = 0; i < (int) lights.size(); i++) all_light_indices[i] = i;
+    
+    light_clusters.is_built = false;
+    light_clusters.max_lights_per_point = (int) lights.size();
+    
+    bool has_radius = false; // or a spot cone
+    for(int i = 0; i < (int) lights.size(); i++) has_radius = has_radius || lights[i].influence_radius > 0.0 || lights[i].is_spotlight;
+    
+    Point3D min_corner(numeric_limits<double>::max(), numeric_limits<double>::max(), numeric_limits<double>::max());
+    Point3D max_corner = (-1) * min_corner;
+    bool has_bounds = false;
+    
+    for(int j = 0; j < (int) objects.size(); j++)
+    {
+        Point3D object_min, object_max;
+        
+        if(!objects[j]->get_bounding_box(object_min, object_max)) continue;
+        
+        min_corner = Point3D(min(min_corner.x, object_min.x), min(min_corner.y, object_min.y), min(min_corner.z, object_min.z));
+        max_corner = Point3D(max(max_corner.x, object_max.x), max(max_corner.y, object_max.y), max(max_corner.z, object_max.z));
+        has_bounds = true;
+    }
+    
+    if((!has_radius && light_samples_per_point == 0) || !has_bounds) return;
+    
+    int resolution = has_radius ? LIGHT_CLUSTER_RESOLUTION : LIGHT_SAMPLING_RESOLUTION;
+    double extent[3] = {max_corner.x - min_corner.x, max_corner.y - min_corner.y, max_corner.z - min_corner.z};
+    double cell_size = max(epsilon, max(extent[0], max(extent[1], extent[2])) / resolution);
+    
+    LightClusterGrid &grid = light_clusters;
+    grid.min_corner = min_corner;
+    grid.cell_size = cell_size;
+    for(int a = 0; a < 3; a++)
+    {
+        grid.num_of_cells[a] = max(1, min(resolution, (int) ceil(extent[a] / cell_size)));
+    }
+    
+    int total_cells = grid.num_of_cells[0] * grid.num_of_cells[1] * grid.num_of_cells[2];
+    vector<vector<int> > cells(total_cells);
+    
+    grid.outside_lights.clear();
+    
+    for(int i = 0; i < (int) lights.size(); i++)
+    {
+        const Point3D &position = lights[i].source_light_position;
+        double radius = lights[i].influence_radius;
+        int low[3], high[3];
+        double coordinates[3] = {position.x - min_corner.x, position.y - min_corner.y, position.z - min_corner.z};
+        bool reaches_outside = radius <= 0.0;
+        
+        for(int a = 0; a < 3; a++)
+        {
+            reaches_outside = reaches_outside || coordinates[a] - radius <= 0.0 || coordinates[a] + radius >= grid.num_of_cells[a] * cell_size;
+        }
+        if(reaches_outside) grid.outside_lights.push_back(i);
+        
+        for(int a = 0; a < 3; a++)
+        {
+            low[a] = 0;
+            high[a] = grid.num_of_cells[a] - 1;
+            
+            if(radius > 0.0)
+            {
+                low[a] = max(low[a], (int) floor((coordinates[a] - radius) / cell_size));
+                high[a] = min(high[a], (int) floor((coordinates[a] + radius) / cell_size));
+            }
+        }
+        
+        for(int x = low[0]; x <= high[0]; x++)
+        {
+            for(int y = low[1]; y <= high[1]; y++)
+            {
+                for(int z = low[2]; z <= high[2]; z++)
+                {
+                    if(lights[i].is_spotlight)
+                    {
+                        Point3D cell_center = min_corner + Point3D(x + 0.5, y + 0.5, z + 0.5) * cell_size;
+                        
+                        if(!lights[i].does_spot_cone_reach(cell_center, 0.5 * sqrt(3.0) * cell_size + lights[i].get_extent())) continue;
+                    }
+                    if(radius > 0.0)
+                    {
+                        // distance from the light to the closest point of the cell
+                        int cell[3] = {x, y, z};
+                        double distance_square = 0.0;
+                        
+                        for(int a = 0; a < 3; a++)
+                        {
+                            double closest = max(cell[a] * cell_size, min(coordinates[a], (cell[a] + 1) * cell_size));
+                            distance_square += (coordinates[a] - closest) * (coordinates[a] - closest);
+                        }
+                        if(distance_square > radius * radius) continue;
+                    }
+                    cells[(x * grid.num_of_cells[1] + y) * grid.num_of_cells[2] + z].push_back(i);
+                }
+            }
+        }
+    }
+    
+    grid.cell_start.assign(1, 0);
+    grid.cell_lights.clear();
+    grid.max_lights_per_point = (int) grid.outside_lights.size();
+    
+    for(int c = 0; c < total_cells; c++)
+    {
+        grid.cell_lights.insert(grid.cell_lights.end(), cells[c].begin(), cells[c].end());
+        grid.cell_start.push_back((int) grid.cell_lights.size());
+        grid.max_lights_per_point = max(grid.max_lights_per_point, (int) cells[c].size());
+    }
+    grid.is_built = true;
+}
+
+// indices of the lights that can reach point, in increasing order. table_offset is where the list's entries
+// start in the light sampling tables, which follow cell_lights and then the outside list
+void get_lights_at(const Point3D &point, const int *&begin, const int *&end, int *table_offset = nullptr)
+{
+    const LightClusterGrid &grid = light_clusters;
+    begin = all_light_indices.data();
+    end = begin + all_light_indices.size();
+    if(table_offset) *table_offset = 0;
+    
+    if(!grid.is_built) return;
+    if(table_offset) *table_offset = (int) grid.cell_lights.size();
+    
+    double coordinates[3] = {point.x - grid.min_corner.x, point.y - grid.min_corner.y, point.z - grid.min_corner.z};
+    int cell[3];
+    
+    for(int a = 0; a < 3; a++)
+    {
+        double index = floor(coordinates[a] / grid.cell_size);
+        
+        if(index < 0 || index >= grid.num_of_cells[a])
+        {
+            begin = grid.outside_lights.data();
+            end = begin + grid.outside_lights.size();
+            return;
+        }
+        cell[a] = (int) index;
+    }
+    
+    int c = (cell[0] * grid.num_of_cells[1] + cell[1]) * grid.num_of_cells[2] + cell[2];
+    begin = grid.cell_lights.data() + grid.cell_start[c];
+    end = grid.cell_lights.data() + grid.cell_start[c + 1];
+    if(table_offset) *table_offset = grid.cell_start[c];
+}
+
+/*
+ Stochastic light sampling for scenes with too many lights to loop over. Instead of every light in
+ get_lights_at(), each shading point picks light_samples_per_point of them with probability proportional
+ to their estimated contribution, power / distance^2 from the center of the point's cluster cell (alias
+ table per cell, O(1) per sample; points outside the grid weight by power alone). Every pick is scaled by
+ 1 / (samples * probability), which keeps the expected color equal to the full loop. capture() averages
+ several passes to converge.
+ */
+#define MAX_LIGHT_SAMPLES 16
+
+// one alias table per light list of the cluster grid, stored in lists parallel to cell_lights followed by
+// the outside list (or all_light_indices when the grid is not built); aliases are positions in the same list
+struct LightAliasTables{
+    vector<double> probabilities; // probability of picking each entry of its list
+    vector<double> thresholds;
+    vector<int> aliases;
+    double max_scaled_light; // largest max color channel / probability, bounds the scaled sum of a point's picks
+};
+
+LightAliasTables light_alias_tables;
+
+// Vose's alias method over weights[0 .. n), written to the tables at offset
+void build_alias_table(int offset, int n, const double *weights)
+{
+    LightAliasTables &tables = light_alias_tables;
+    double *probabilities = tables.probabilities.data() + offset;
+    double *thresholds = tables.thresholds.data() + offset;
+    int *aliases = tables.aliases.data() + offset;
+    double total_weight = 0.0;
+    
+    for(int i = 0; i < n; i++) total_weight += weights[i];
+    
+    vector<double> scaled(n);
+    vector<int> small, large;
+    
+    for(int i = 0; i < n; i++)
+    {
+        probabilities[i] = total_weight > 0.0 ? weights[i] / total_weight : 1.0 / n;
+        thresholds[i] = 1.0;
+        aliases[i] = i;
+        scaled[i] = probabilities[i] * n;
+        
+        if(scaled[i] < 1.0) small.push_back(i);
+        else large.push_back(i);
+    }
+    
+    while(!small.empty() && !large.empty())
+    {
+        int less = small.back(), more = large.back();
+        small.pop_back();
+        
+        thresholds[less] = scaled[less];
+        aliases[less] = more;
+        scaled[more] = (scaled[more] + scaled[less]) - 1.0;
+        
+        if(scaled[more] < 1.0)
+        {
+            large.pop_back();
+            small.push_back(more);
+        }
+    }
+}
+
+// call once per frame after build_light_clusters()
+void build_light_alias_table()
+{
+    LightAliasTables &tables = light_alias_tables;
+    const LightClusterGrid &grid = light_clusters;
+    const vector<int> &outside = grid.is_built ? grid.outside_lights : all_light_indices;
+    int outside_offset = grid.is_built ? (int) grid.cell_lights.size() : 0;
+    int total = outside_offset + (int) outside.size();
+    vector<double> weights(total);
+    
+    tables.probabilities.resize(total);
+    tables.thresholds.resize(total);
+    tables.aliases.resize(total);
+    tables.max_scaled_light = 0.0;
+    
+    if(light_samples_per_point == 0) return;
+    
+    for(int k = 0; k < total; k++)
+    {
+        int i = k < outside_offset ? grid.cell_lights[k] : outside[k - outside_offset];
+        weights[k] = lights[i].color[0] + lights[i].color[1] + lights[i].color[2];
+    }
+    
+    if(grid.is_built)
+    {
+        double min_distance_square = 0.75 * grid.cell_size * grid.cell_size; // half the cell diagonal
+        
+        for(int x = 0; x < grid.num_of_cells[0]; x++)
+        {
+            for(int y = 0; y < grid.num_of_cells[1]; y++)
+            {
+                for(int z = 0; z < grid.num_of_cells[2]; z++)
+                {
+                    int c = (x * grid.num_of_cells[1] + y) * grid.num_of_cells[2] + z;
+                    Point3D cell_center = grid.min_corner + Point3D(x + 0.5, y + 0.5, z + 0.5) * grid.cell_size;
+                    
+                    for(int k = grid.cell_start[c]; k < grid.cell_start[c + 1]; k++)
+                    {
+                        Point3D offset = lights[grid.cell_lights[k]].source_light_position - cell_center;
+                        weights[k] /= max(min_distance_square, vector_dot_product(offset, offset));
+                    }
+                    build_alias_table(grid.cell_start[c], grid.cell_start[c + 1] - grid.cell_start[c], weights.data() + grid.cell_start[c]);
+                }
+            }
+        }
+    }
+    build_alias_table(outside_offset, (int) outside.size(), weights.data() + outside_offset);
+    
+    for(int k = 0; k < total; k++)
+    {
+        int i = k < outside_offset ? grid.cell_lights[k] : outside[k - outside_offset];
+        
+        if(tables.probabilities[k] <= 0.0) continue; // never picked
+        tables.max_scaled_light = max(tables.max_scaled_light, max(lights[i].color[0], max(lights[i].color[1], lights[i].color[2])) / tables.probabilities[k]);
+    }
+}
+
+// the lights a shading point loops over, with the factor each one's contribution is scaled by
+struct LightSelection{
+    const int *indices;
+    int count;
+    bool is_sampled;
+    int sampled_indices[MAX_LIGHT_SAMPLES];
+    double sampled_scales[MAX_LIGHT_SAMPLES];
+    
+    double get_scale(int k) const
+    {
+        return is_sampled ? sampled_scales[k] : 1.0;
+    }
+};
+
+void select_lights(const Point3D &point, LightSelection &selection)
+{
+    const LightAliasTables &tables = light_alias_tables;
+    const int *begin, *end;
+    int table_offset;
+    
+    get_lights_at(point, begin, end, &table_offset);
+    selection.indices = begin;
+    selection.count = (int) (end - begin);
+    selection.is_sampled = light_samples_per_point > 0 && selection.count > 0;
+    
+    if(!selection.is_sampled) return;
+    
+    int samples = min(light_samples_per_point, MAX_LIGHT_SAMPLES);
+    
+    for(int k = 0; k < samples; k++)
+    {
+        // u1 picks an entry of the point's list, u2 decides between it and its alias
+        double u1 = get_next_sample(), u2 = get_next_sample();
+        int entry = min((int) (u1 * selection.count), selection.count - 1);
+        
+        if(u2 >= tables.thresholds[table_offset + entry]) entry = tables.aliases[table_offset + entry];
+        
+        selection.sampled_indices[k] = begin[entry];
+        selection.sampled_scales[k] = 1.0 / (samples * tables.probabilities[table_offset + entry]);
+    }
+    selection.indices = selection.sampled_indices;
+    selection.count = samples;
+}
+
+// most lights select_lights() can return for one point
+int get_max_lights_per_point()
+{
+    if(light_samples_per_point > 0) return min(light_samples_per_point, MAX_LIGHT_SAMPLES);
+    if(light_clusters.is_built) return light_clusters.max_lights_per_point;
+    
+    return (int) lights.size();
+}
+
+// base^exponent by squaring, the specular exponent is an integer in the scene file
+double integer_power(double base, int exponent)
+{
+    if(exponent < 0) return pow(base, exponent);
+    
+    double result = 1.0;
+    while(exponent > 0)
+    {
+        if(exponent & 1) result *= base;
+        base *= base;
+        exponent >>= 1;
+    }
+    return result;
+}
+
+// diffuse + specular color an unobscured light adds to the intersection point, false when it adds nothing
+// scale is the attenuation of the light times the weight of a sampled light
+template<bool DIFFUSE, bool SPECULAR>
+bool get_light_contribution(Object *object, const Light &light, double scale, const Ray &light_ray, const Ray &ray, const Point3D &normal, const Point3D &reflection, const double surface_color[3], double contribution[3])
+{
+    if(scale <= 0.0) return false; // out of the influence radius
+    
+    double phong_diffuse = 0.0, phong_specular = 0.0;
+    
+    if(DIFFUSE)
+    {
+        // calculate lambert diffuse value
+        double L_dot_N = vector_dot_product(light_ray.direction, normal); //(L_dot_N)=> L = light source incident ray
+        L_dot_N = max(0.0, L_dot_N); //when theta is negative
+        phong_diffuse = object->reflection_coefficients[1] * L_dot_N;
+    }
+    
+    if(SPECULAR)
+    {
+        // calculate phong specular value
+        double R_dot_V = vector_dot_product(reflection, ray.direction); //(R_dot_V)=>V = eye ray direction
+        R_dot_V = max(0.0, R_dot_V);
+        phong_specular = object->reflection_coefficients[2] * integer_power(R_dot_V, object->shininess); // I_spec = K_spec * (R . V)^shininess
+    }
+    
+    if(phong_diffuse + phong_specular == 0.0) return false; // light is behind the surface, no need for a shadow ray
+    
+    //set diffuse and specular color. Formula from schaums's outline book
+    for(int j = 0; j < 3; j++)
+    {
+        contribution[j] = light.color[j] * (phong_diffuse + phong_specular) * surface_color[j];
+        if(scale != 1.0) contribution[j] *= scale;
+    }
+    return true;
+}
 
-    virtual double intersect(const Ray &ray, vector<double> &changed_color, int level)
+// upper bound of the color any ray can gather, call after the scene, lights or light sampling tables change
+void update_max_radiance_bound()
+{
+    double light_sum = 0.0;
+    for(int i = 0; i < lights.size(); i++)
     {
-        return -1.0;
+        light_sum += max(lights[i].color[0], max(lights[i].color[1], lights[i].color[2]));
     }
+    // each of a sampled point's picks adds at most max channel / (samples * probability)
+    if(light_samples_per_point > 0) light_sum = light_alias_tables.max_scaled_light;
     
-    virtual void print_object()
+    double max_local = 0.0, max_reflection = 0.0;
+    for(int i = 0; i < (int) objects.size(); i++)
     {
-
+        const vector<double> &k = objects[i]->reflection_coefficients;
+        double max_color = max(1.0, max(objects[i]->color[0], max(objects[i]->color[1], objects[i]->color[2]))); // floor tiles go up to 1
+        
+        max_local = max(max_local, max_color * (k[0] + (k[1] + k[2]) * light_sum));
+        max_reflection = max(max_reflection, k[3]);
     }
+    
+    // B <= max_local + max_reflection * B
+    if(max_reflection < 1.0) max_radiance_bound = max_local / (1.0 - max_reflection);
+    else max_radiance_bound = numeric_limits<double>::max();
+}
 
-    virtual ~Object()
-    {
-        reference_point = Point3D();
-        color.clear();
-        reflection_coefficients.clear();
-        height = width = length = 0.0;
-        shininess = 0;
-    }
-};
+// probability of tracing a reflection ray whose path weight (product of reflection coefficients) is reflection_weight
+double get_reflection_survival_probability(double reflection_weight)
+{
+    if(reflection_termination_mode == TERMINATE_NONE) return 1.0;
+    
+    double max_contribution = reflection_weight * max_radiance_bound;
+    
+    if(max_contribution >= reflection_contribution_threshold) return 1.0;
+    if(reflection_termination_mode == TERMINATE_THRESHOLD) return 0.0;
+    
+    return max_contribution / reflection_contribution_threshold;
+}
 
-vector<Object*> objects;
-vector<Light> lights;
-int level_of_recursion;
+// 0 when the reflection ray is dropped, otherwise the factor that keeps the estimate unbiased (1 / survival probability)
+double get_reflection_survival_scale(double reflection_weight)
+{
+    double survival = get_reflection_survival_probability(reflection_weight);
+    
+    if(survival >= 1.0) return 1.0;
+    if(survival <= 0.0 || get_next_sample() >= survival) return 0.0;
+    
+    return 1.0 / survival;
+}
+
+Ray get_reflection_ray(const Point3D &intersection_point, const Point3D &reflection)
+{
+    Point3D reflection_ray_start = intersection_point + 0.001 * reflection; //slight up to avoid own intersection
+    
+    return Ray(reflection_ray_start, reflection);
+}
+
+// weight is the product of the reflection coefficients of the path that reached this intersection
+void coloring_illumination_reflection(Object *object, const Ray &ray, double t, vector<double> &changed_color, int level, double weight = 1.0);
 
-void coloring_illumination_reflection(Object *object, const Ray &ray, double t, vector<double> &changed_color, int level)
+// Shading of one intersection with the terms of the disabled material features compiled out
+template<bool DIFFUSE, bool SPECULAR, bool REFLECTIVE>
+void shade_intersection(Object *object, const Ray &ray, double t, vector<double> &changed_color, int level, double weight)
 {
     //intersection point equation --> (ro + t * rd)
     Point3D intersection_point = ray.start + t * ray.direction;
     Point3D normal = object->get_normal_vector(intersection_point);
-    Point3D reflection = object->get_reflection_vector(ray.direction, normal);
+    Point3D reflection;
+    double surface_color[3];
+    object->get_surface_color(intersection_point, surface_color);
+    
+    if(SPECULAR || REFLECTIVE) reflection = object->get_reflection_vector(ray.direction, normal);
     
     /* ********************************* ILLUMINATION START ********************************* */
     
     // set ambient color
     for(int i = 0; i < 3; i++)
     {
-        changed_color[i] = object->color[i] * object->reflection_coefficients[0];
+        changed_color[i] = surface_color[i] * object->reflection_coefficients[0];
     }
     
-    for(int i = 0; i < lights.size(); i++)
+    LightSelection selection;
+    if(DIFFUSE || SPECULAR) select_lights(intersection_point, selection);
+    
+    for(int k = 0; (DIFFUSE || SPECULAR) && k < selection.count; k++)
     {
-        /* Construct L ray like in the picture. direction = (lightSource - intersectionPoint) then normalize it */
-        Point3D light_ray_direction = lights[i].source_light_position - intersection_point;
-        light_ray_direction.normalize_point();
-        
-        Point3D light_ray_start = intersection_point +  0.001 * light_ray_direction;// 0.001 is for taking slightly above the point so it doesn’t again intersect with same object due to precision
+        int i = selection.indices[k];
+        double spot_factor = lights[i].get_spot_factor(intersection_point);
         
-        Ray light_ray(light_ray_start, light_ray_direction);
+        if(spot_factor <= 0.0) continue; // outside the spot cone, no shading and no shadow ray
         
-        // For each object now check whether this L ray obscured by any object or not.
-        bool is_obscured = false;
+        Ray light_ray = get_light_ray(lights[i], intersection_point);
         double dist_from_light_to_intersection = distance_between_points(lights[i].source_light_position, intersection_point);
+        double scale = lights[i].get_attenuation(dist_from_light_to_intersection) * selection.get_scale(k) * spot_factor;
+        double contribution[3];
         
-        for(int j = 0; j < objects.size(); j++)
-        {
-            double t_value = objects[j]->get_intersection_point_t_value(light_ray);
-            
-            if(t_value > 0.0 && t_value <= dist_from_light_to_intersection)
-            {
-                is_obscured = true;
-                break;
-            }
-        }
+        if(!get_light_contribution<DIFFUSE, SPECULAR>(object, lights[i], scale, light_ray, ray, normal, reflection, surface_color, contribution)) continue;
         
         // If it is not obscured that means light falls onto the intersection point, I have to update current_color
-        if(!is_obscured)
+        double visibility = lights[i].is_area_light() ? get_light_visibility(i, intersection_point, object) : (is_light_ray_obscured(i, light_ray, dist_from_light_to_intersection) ? 0.0 : 1.0);
+        
+        if(visibility > 0.0)
         {
-            // calculate lambert diffuse value
-            double L_dot_N = vector_dot_product(light_ray.direction, normal); //(L_dot_N)=> L = light source incident ray
-            L_dot_N = max(0.0, L_dot_N); //when theta is negative
-            double phong_diffuse = object->reflection_coefficients[1] * L_dot_N;
-            
-            // calculate phong specular value
-            double R_dot_V = vector_dot_product(reflection, ray.direction); //(R_dot_V)=>V = eye ray direction
-            R_dot_V = max(0.0, R_dot_V);
-            double phong_specular = object->reflection_coefficients[2] * pow(R_dot_V, object->shininess); // I_spec = K_spec * (R . V)^shininess
-            
-            //set diffuse and specular color. Formula from schaums's outline book
             for(int j = 0; j < 3; j++)
             {
-                changed_color[j] += lights[i].color[j] * (phong_diffuse + phong_specular) * object->color[j];
+                changed_color[j] += contribution[j] * visibility;
             }
         }
     }
@@ -334,46 +2288,332 @@ void coloring_illumination_reflection(Object *object, const Ray &ray, double t,
     
     /* ********************************* REFLECTION START ********************************* */
     
-    if(level < level_of_recursion)
+    if(!REFLECTIVE) return;
+    
+    double reflection_weight = weight * object->reflection_coefficients[3];
+    double survival_scale = level < level_of_recursion ? get_reflection_survival_scale(reflection_weight) : 0.0;
+    
+    if(survival_scale > 0.0)
     {
-        Point3D reflection_ray_start = intersection_point + 0.001 * reflection; //slight up to avoid own intersection
-        
-        Ray reflection_ray(reflection_ray_start, reflection);
+        Ray reflection_ray = get_reflection_ray(intersection_point, reflection);
         
-        // Like capture method, find the nearest intersecting object, using intersect function
-        int nearest_reflection = -1;
-        double t_reflection;
-        double t_min_reflection = numeric_limits<double>::max();
+        // Like capture method, find the nearest intersecting object
+        double t_min_reflection;
         vector<double> reflection_color(3);
+        int nearest_reflection = find_nearest_object(reflection_ray, t_min_reflection);
         
-        for(int k = 0; k < objects.size(); k++)
+        if(nearest_reflection != -1)
         {
-            t_reflection = objects[k]->intersect(reflection_ray, reflection_color, 0);
+            coloring_illumination_reflection(objects[nearest_reflection], reflection_ray, t_min_reflection, reflection_color, level + 1, reflection_weight * survival_scale);
             
-            if(t_reflection < t_min_reflection && t_reflection > 0)
+            for(int k = 0; k < 3; k++)
             {
-                t_min_reflection = t_reflection;
-                nearest_reflection = k;
+                changed_color[k] += reflection_color[k] * object->reflection_coefficients[3] * survival_scale;
             }
         }
+        reflection_color.clear();
+    }
+    
+    /* ********************************* REFLECTION END ********************************* */
+}
+
+typedef void (*ShadingKernel)(Object *, const Ray &, double, vector<double> &, int, double);
+
+// indexed by Object::material_mask
+const ShadingKernel shading_kernels[NUM_OF_MATERIAL_KERNELS] = {
+    shade_intersection<false, false, false>,
+    shade_intersection<true, false, false>,
+    shade_intersection<false, true, false>,
+    shade_intersection<true, true, false>,
+    shade_intersection<false, false, true>,
+    shade_intersection<true, false, true>,
+    shade_intersection<false, true, true>,
+    shade_intersection<true, true, true>
+};
+
+void coloring_illumination_reflection(Object *object, const Ray &ray, double t, vector<double> &changed_color, int level, double weight)
+{
+    shading_kernels[object->material_mask](object, ray, t, changed_color, level, weight);
+}
+
+/* ********************************* WAVEFRONT RENDERER ********************************* */
+
+/*
+ Iterative alternative to the recursion above. Instead of following one pixel through all of its
+ reflections, every stage runs over a whole batch of rays in parallel:
+   intersect all rays -> shade hits, queue shadow and reflection rays -> trace shadow queue -> repeat with reflection queue
+ A path keeps the product of reflection coefficients along the way as its weight, so the
+ result equals the recursive sum ambient + lights + k_r * (ambient + lights + k_r * (...)).
+ */
+
+#define WAVEFRONT_BATCH_SIZE 65536
+#define SHADOW_TILE_SIZE 64 // consecutive rays of a batch whose shadow rays are grouped into packets
+
+struct WavefrontRay{
+    Ray ray;
+    int pixel; // index into the color buffer
+    double weight; // product of reflection coefficients along the path
+    SampleState sample; // continues with the next dimension at every bounce
+};
+
+struct WavefrontShadowRay{
+    Ray ray;
+    int light_index;
+    double distance; // distance from the intersection point to the light
+    double contribution[3]; // weighted color added to the pixel if the ray is not obscured
+    bool active;
+    bool is_visibility_applied; // area lights are tested while shading, contribution already holds the visible part
+};
+
+// Shades one hit of the wavefront: adds the ambient term to the pixel, fills one shadow ray slot per light
+// of select_lights() (get_max_lights_per_point() slots) and returns true when reflection_ray was filled for the next bounce
+template<bool DIFFUSE, bool SPECULAR, bool REFLECTIVE>
+bool shade_wavefront_hit(Object *object, const WavefrontRay &current, double t, vector<double> &pixel_colors, WavefrontShadowRay *shadow_rays, bool spawn_reflection, WavefrontRay &reflection_ray)
+{
+    Point3D intersection_point = current.ray.start + t * current.ray.direction;
+    Point3D normal = object->get_normal_vector(intersection_point);
+    Point3D reflection;
+    double surface_color[3];
+    object->get_surface_color(intersection_point, surface_color);
+    sample_state = current.sample;
+    
+    if(SPECULAR || REFLECTIVE) reflection = object->get_reflection_vector(current.ray.direction, normal);
+    
+    for(int k = 0; k < 3; k++)
+    {
+        pixel_colors[3 * current.pixel + k] += current.weight * surface_color[k] * object->reflection_coefficients[0];
+    }
+    
+    LightSelection selection;
+    if(DIFFUSE || SPECULAR) select_lights(intersection_point, selection);
+    
+    for(int slot = 0; (DIFFUSE || SPECULAR) && slot < selection.count; slot++)
+    {
+        int l = selection.indices[slot];
+        WavefrontShadowRay &shadow_ray = shadow_rays[slot];
+        double spot_factor = lights[l].get_spot_factor(intersection_point);
         
-        if(nearest_reflection != -1)
+        shadow_ray.active = false;
+        if(spot_factor <= 0.0) continue; // outside the spot cone, no shading and no shadow ray
+        
+        shadow_ray.ray = get_light_ray(lights[l], intersection_point);
+        shadow_ray.light_index = l;
+        shadow_ray.distance = distance_between_points(lights[l].source_light_position, intersection_point);
+        double scale = lights[l].get_attenuation(shadow_ray.distance) * selection.get_scale(slot) * spot_factor;
+        shadow_ray.active = get_light_contribution<DIFFUSE, SPECULAR>(object, lights[l], scale, shadow_ray.ray, current.ray, normal, reflection, surface_color, shadow_ray.contribution);
+        shadow_ray.is_visibility_applied = lights[l].is_area_light();
+        
+        if(!shadow_ray.active) continue;
+        
+        double visibility = shadow_ray.is_visibility_applied ? get_light_visibility(l, intersection_point, object) : 1.0;
+        shadow_ray.active = visibility > 0.0;
+        
+        for(int k = 0; k < 3; k++)
         {
-            t_min_reflection = objects[nearest_reflection]->intersect(reflection_ray, reflection_color, level + 1);
+            shadow_ray.contribution[k] *= current.weight * visibility;
+        }
+    }
+    
+    if(!REFLECTIVE || !spawn_reflection) return false;
+    
+    double reflection_weight = current.weight * object->reflection_coefficients[3];
+    double survival_scale = get_reflection_survival_scale(reflection_weight);
+    
+    if(survival_scale <= 0.0) return false;
+    
+    reflection_ray.ray = get_reflection_ray(intersection_point, reflection);
+    reflection_ray.pixel = current.pixel;
+    reflection_ray.weight = reflection_weight * survival_scale;
+    reflection_ray.sample = sample_state;
+    return true;
+}
+
+typedef bool (*WavefrontShadingKernel)(Object *, const WavefrontRay &, double, vector<double> &, WavefrontShadowRay *, bool, WavefrontRay &);
+
+// indexed by Object::material_mask
+const WavefrontShadingKernel wavefront_shading_kernels[NUM_OF_MATERIAL_KERNELS] = {
+    shade_wavefront_hit<false, false, false>,
+    shade_wavefront_hit<true, false, false>,
+    shade_wavefront_hit<false, true, false>,
+    shade_wavefront_hit<true, true, false>,
+    shade_wavefront_hit<false, false, true>,
+    shade_wavefront_hit<true, false, true>,
+    shade_wavefront_hit<false, true, true>,
+    shade_wavefront_hit<true, true, true>
+};
+
+// primary_hits (optional) receives the object index hit by the primary ray of every pixel, -1 for none.
+// Returns early with partial colors once the render is cancelled
+void trace_wavefront_batch(vector<WavefrontRay> &queue, vector<double> &pixel_colors, vector<int> *primary_hits)
+{
+    int num_of_slots = get_max_lights_per_point(); // shadow ray slots of every ray
+    vector<WavefrontRay> next_queue;
+    vector<char> has_reflection;
+    vector<WavefrontShadowRay> shadow_queue;
+    
+    for(int level = 1; !queue.empty(); level++)
+    {
+        int n = (int) queue.size();
+        bool spawn_reflection = level < level_of_recursion;
+        
+        next_queue.resize(n);
+        has_reflection.assign(n, false);
+        shadow_queue.resize((size_t) n * num_of_slots);
+        
+        // intersect + shade stage
+        parallel_for_dynamic(n, SHADOW_TILE_SIZE * 4, [&](int begin, int end) {
+            if(is_render_cancelled()) return;
             
-            for(int k = 0; k < 3; k++)
+            for(int i = begin; i < end; i++)
+            {
+                const WavefrontRay &current = queue[i];
+                double t;
+                int nearest = find_nearest_object(current.ray, t);
+                
+                if(level == 1 && primary_hits != nullptr) (*primary_hits)[current.pixel] = nearest;
+                
+                for(int slot = 0; slot < num_of_slots; slot++)
+                {
+                    shadow_queue[(size_t) i * num_of_slots + slot].active = false;
+                }
+                
+                if(nearest == -1) continue;
+                
+                Object *object = objects[nearest];
+                has_reflection[i] = wavefront_shading_kernels[object->material_mask](object, current, t, pixel_colors, &shadow_queue[(size_t) i * num_of_slots], spawn_reflection, next_queue[i]);
+            }
+        });
+        if(is_render_cancelled()) return; // the shadow queue is incomplete
+        
+        // shadow stage, traced per tile of consecutive rays as packets towards one light
+        int num_of_tiles = (n + SHADOW_TILE_SIZE - 1) / SHADOW_TILE_SIZE;
+        
+        parallel_for_dynamic(num_of_tiles, 4, [&](int begin, int end) {
+            if(is_render_cancelled()) return;
+            
+            vector<char> occluded(SHADOW_TILE_SIZE * num_of_slots);
+            vector<pair<pair<int, int>, int> > grouped_rays; // ((light, grid cell), slot in the tile) of the active shadow rays
+            ShadowRayPacket packet;
+            
+            for(int tile = begin; tile < end; tile++)
             {
-                changed_color[k] += reflection_color[k] * object->reflection_coefficients[3];
+                int first = tile * SHADOW_TILE_SIZE;
+                int last = min(n, first + SHADOW_TILE_SIZE);
+                
+                grouped_rays.clear();
+                for(int k = first * num_of_slots; k < last * num_of_slots; k++)
+                {
+                    const WavefrontShadowRay &shadow_ray = shadow_queue[k];
+                    
+                    occluded[k - first * num_of_slots] = 0;
+                    if(shadow_ray.active && !shadow_ray.is_visibility_applied) grouped_rays.push_back(make_pair(make_pair(shadow_ray.light_index, get_occluder_grid_cell((-1) * shadow_ray.ray.direction)), k - first * num_of_slots));
+                }
+                sort(grouped_rays.begin(), grouped_rays.end());
+                
+                // packets of up to SHADOW_PACKET_SIZE rays towards the same light from the same cell
+                for(int k = 0; k < (int) grouped_rays.size(); )
+                {
+                    pair<int, int> group = grouped_rays[k].first;
+                    char packet_occluded[SHADOW_PACKET_SIZE] = {0};
+                    int lane_slots[SHADOW_PACKET_SIZE];
+                    
+                    packet.size = 0;
+                    for(; k < (int) grouped_rays.size() && grouped_rays[k].first == group && packet.size < SHADOW_PACKET_SIZE; k++)
+                    {
+                        const WavefrontShadowRay &shadow_ray = shadow_queue[(size_t) first * num_of_slots + grouped_rays[k].second];
+                        int lane = packet.size++;
+                        
+                        lane_slots[lane] = grouped_rays[k].second;
+                        packet.start_x[lane] = shadow_ray.ray.start.x;
+                        packet.start_y[lane] = shadow_ray.ray.start.y;
+                        packet.start_z[lane] = shadow_ray.ray.start.z;
+                        packet.direction_x[lane] = shadow_ray.ray.direction.x;
+                        packet.direction_y[lane] = shadow_ray.ray.direction.y;
+                        packet.direction_z[lane] = shadow_ray.ray.direction.z;
+                        packet.distance[lane] = shadow_ray.distance;
+                    }
+                    for(int lane = packet.size; lane < SHADOW_PACKET_SIZE; lane++)
+                    {
+                        packet.start_x[lane] = packet.start_y[lane] = packet.start_z[lane] = 0.0;
+                        packet.direction_x[lane] = packet.direction_y[lane] = 0.0;
+                        packet.direction_z[lane] = 1.0;
+                        packet.distance[lane] = -1.0;
+                    }
+                    
+                    trace_shadow_packet(group.first, packet, group.second, packet_occluded);
+                    
+                    for(int lane = 0; lane < packet.size; lane++)
+                    {
+                        occluded[lane_slots[lane]] = packet_occluded[lane];
+                    }
+                }
+                
+                // the lights of one ray are added in order, so every pixel is written by a single thread
+                for(int i = first; i < last; i++)
+                {
+                    for(int slot = 0; slot < num_of_slots; slot++)
+                    {
+                        const WavefrontShadowRay &shadow_ray = shadow_queue[(size_t) i * num_of_slots + slot];
+                        
+                        if(!shadow_ray.active || occluded[(i - first) * num_of_slots + slot]) continue;
+                        
+                        for(int k = 0; k < 3; k++)
+                        {
+                            pixel_colors[3 * queue[i].pixel + k] += shadow_ray.contribution[k];
+                        }
+                    }
+                }
             }
+        });
+        if(is_render_cancelled()) return;
+        
+        // compact the reflection rays into the queue of the next bounce
+        int count = 0;
+        for(int i = 0; i < n; i++)
+        {
+            if(has_reflection[i]) next_queue[count++] = next_queue[i];
         }
-        reflection_color.clear();
+        next_queue.resize(count);
+        queue.swap(next_queue);
     }
+}
+
+// pixel_colors receives 3 doubles (RGB, unclamped) for every primary ray, primary_hits the index of the object it hit.
+// primary_samples (optional) holds the sampler state each path starts with. A cancelled render stops after the
+// stage it is in, the colors are then incomplete
+void render_wavefront(const vector<Ray> &primary_rays, vector<double> &pixel_colors, vector<int> *primary_hits = nullptr, const vector<SampleState> *primary_samples = nullptr)
+{
+    pixel_colors.assign(3 * primary_rays.size(), 0.0);
+    if(primary_hits != nullptr) primary_hits->assign(primary_rays.size(), -1);
     
-    /* ********************************* REFLECTION END ********************************* */
+    vector<WavefrontRay> queue;
+    
+    for(int begin = 0; begin < (int) primary_rays.size() && !is_render_cancelled(); begin += WAVEFRONT_BATCH_SIZE)
+    {
+        int end = min((int) primary_rays.size(), begin + WAVEFRONT_BATCH_SIZE);
+        
+        queue.resize(end - begin);
+        for(int i = begin; i < end; i++)
+        {
+            queue[i - begin].ray = primary_rays[i];
+            queue[i - begin].pixel = i;
+            queue[i - begin].weight = 1.0;
+            queue[i - begin].sample = primary_samples != nullptr ? (*primary_samples)[i] : SampleState{0, 0, (unsigned int) i, 0};
+        }
+        
+        trace_wavefront_batch(queue, pixel_colors, primary_hits);
+    }
 }
 
+/* ********************************* WAVEFRONT RENDERER END ********************************* */
+
+
 class Sphere : public Object{
 
+    // origin dependent terms of get_intersection_point_t_value(), filled by precompute_origin_terms()
+    Point3D origin_Ro;
+    double origin_Ro_dot_Ro;
+
 public:
     Sphere(const Point3D &center, double radius)
     {
@@ -398,6 +2638,12 @@ public:
         return normal;
     }
     
+    // the sphere only hides the light below the tangent plane at point
+    bool may_shadow_itself(const Point3D &point, const Point3D &light_center, double extent) const override
+    {
+        return vector_dot_product(light_center - point, point - reference_point) < extent * height;
+    }
+    
     double get_intersection_point_t_value(const Ray &ray) override
     {
         //Geometric Ray-Sphere Intersection
@@ -442,10 +2688,61 @@ public:
         
         return t;
     }
+    
+    bool get_bounding_sphere(Point3D &center, double &radius) override
+    {
+        center = reference_point;
+        radius = height;
+        return true;
+    }
+    
+    void occlude_packet(const ShadowRayPacket &packet, char occluded[]) override
+    {
+        // get_intersection_point_t_value() without branches, one lane per ray
+        double r_square = height * height;
+        
+        for(int k = 0; k < SHADOW_PACKET_SIZE; k++)
+        {
+            double Ro_x = packet.start_x[k] - reference_point.x;
+            double Ro_y = packet.start_y[k] - reference_point.y;
+            double Ro_z = packet.start_z[k] - reference_point.z;
+            
+            double Ro_dot_Ro = Ro_x * Ro_x + Ro_y * Ro_y + Ro_z * Ro_z;
+            double tp = (-Ro_x) * packet.direction_x[k] + (-Ro_y) * packet.direction_y[k] + (-Ro_z) * packet.direction_z[k];
+            double d_square = Ro_dot_Ro - tp * tp;
+            double t_prime = sqrt(max(0.0, r_square - d_square));
+            double t = Ro_dot_Ro < r_square ? tp + t_prime : tp - t_prime;
+            
+            bool hit = tp > 0 && d_square <= r_square && t > 0.0 && t <= packet.distance[k];
+            occluded[k] = occluded[k] | hit;
+        }
+    }
+    
+    void precompute_origin_terms(const Point3D &origin) override
+    {
+        origin_Ro = origin - reference_point;
+        origin_Ro_dot_Ro = vector_dot_product(origin_Ro, origin_Ro);
+    }
+    
+    double get_shared_origin_t_value(const Ray &ray) override
+    {
+        //same as get_intersection_point_t_value() with Ro and Ro.Ro taken from the cache
+        double r_square = height * height;
+        double tp = vector_dot_product((-1) * origin_Ro, ray.direction);
+        double d_square = origin_Ro_dot_Ro - tp * tp;
+
+        if(tp <= 0 || d_square > r_square) return -1.0;
+
+        double t_prime = sqrt(r_square - d_square);
+
+        if(origin_Ro_dot_Ro < r_square) return tp + t_prime;
+        
+        return tp - t_prime;
+    }
 
     double intersect(const Ray &ray, vector<double> &changed_color, int level) override
     {
-        double t = get_intersection_point_t_value(ray);
+        double t = get_t_value(ray);
         
         if(t <= 0) return -1.0;
 
@@ -491,6 +2788,10 @@ public:
 
 class Triangle : public Object{
 
+    // origin dependent terms of the Moller-Trumbore test, filled by precompute_origin_terms()
+    Point3D origin_edge1, origin_edge2, origin_s, origin_q;
+    double origin_edge2_dot_q;
+
 public:
     Triangle(const Point3D &a, const Point3D &b, const Point3D &c)
     {
@@ -538,9 +2839,88 @@ public:
         else return -1.0;
     }
     
+    void occlude_packet(const ShadowRayPacket &packet, char occluded[]) override
+    {
+        // Moller-Trumbore without branches, one lane per ray
+        Point3D edge1 = triangle_end_points[1] - triangle_end_points[0];
+        Point3D edge2 = triangle_end_points[2] - triangle_end_points[0];
+        
+        for(int k = 0; k < SHADOW_PACKET_SIZE; k++)
+        {
+            double d_x = packet.direction_x[k], d_y = packet.direction_y[k], d_z = packet.direction_z[k];
+            
+            double h_x = d_y * edge2.z - d_z * edge2.y;
+            double h_y = d_z * edge2.x - d_x * edge2.z;
+            double h_z = d_x * edge2.y - d_y * edge2.x;
+            double a = edge1.x * h_x + edge1.y * h_y + edge1.z * h_z;
+            double f = 1.0 / a;
+            
+            double s_x = packet.start_x[k] - triangle_end_points[0].x;
+            double s_y = packet.start_y[k] - triangle_end_points[0].y;
+            double s_z = packet.start_z[k] - triangle_end_points[0].z;
+            double u = f * (s_x * h_x + s_y * h_y + s_z * h_z);
+            
+            double q_x = s_y * edge1.z - s_z * edge1.y;
+            double q_y = s_z * edge1.x - s_x * edge1.z;
+            double q_z = s_x * edge1.y - s_y * edge1.x;
+            double v = f * (d_x * q_x + d_y * q_y + d_z * q_z);
+            double t = f * (edge2.x * q_x + edge2.y * q_y + edge2.z * q_z);
+            
+            bool hit = !(a > -epsilon && a < epsilon) && u >= 0.0 && u <= 1.0 && v >= 0.0 && u + v <= 1.0 && t > epsilon && t <= packet.distance[k];
+            occluded[k] = occluded[k] | hit;
+        }
+    }
+    
+    bool get_bounding_sphere(Point3D &center, double &radius) override
+    {
+        center = (triangle_end_points[0] + triangle_end_points[1] + triangle_end_points[2]) * (1.0 / 3);
+        radius = 0.0;
+        for(int i = 0; i < 3; i++)
+        {
+            radius = max(radius, distance_between_points(center, triangle_end_points[i]));
+        }
+        return true;
+    }
+    
+    bool may_shadow_itself(const Point3D &point, const Point3D &light_center, double extent) const override
+    {
+        return false; // flat
+    }
+    
+    void precompute_origin_terms(const Point3D &origin) override
+    {
+        origin_edge1 = triangle_end_points[1] - triangle_end_points[0];
+        origin_edge2 = triangle_end_points[2] - triangle_end_points[0];
+        origin_s = origin - triangle_end_points[0];
+        origin_q = vector_cross_product(origin_s, origin_edge1); // q = s x edge1 does not depend on the ray direction
+        origin_edge2_dot_q = vector_dot_product(origin_edge2, origin_q);
+    }
+    
+    double get_shared_origin_t_value(const Ray &ray) override
+    {
+        Point3D h = vector_cross_product(ray.direction, origin_edge2);
+        double a = vector_dot_product(origin_edge1, h);
+        
+        if(a > -epsilon && a < epsilon) return -1.0;
+        
+        double f = 1.0 / a;
+        double u = f * vector_dot_product(origin_s, h);
+        
+        if(u < 0.0 || u > 1.0) return -1.0;
+        
+        double v = f * vector_dot_product(ray.direction, origin_q);
+        
+        if(v < 0.0 || u + v > 1.0) return -1.0;
+        
+        double t = f * origin_edge2_dot_q;
+        
+        if(t > epsilon) return t;
+        else return -1.0;
+    }
+    
     double intersect(const Ray &ray, vector<double> &changed_color, int level) override
     {
-        double t = get_intersection_point_t_value(ray);
+        double t = get_t_value(ray);
         if(t <= 0 ) return -1.0;
         
         // between near and far plane check
@@ -598,6 +2978,11 @@ public:
 
 class GeneralObject : public Object{
 
+    // origin dependent terms of the quadratic, filled by precompute_origin_terms()
+    // b = origin_b.x * Rd.x + origin_b.y * Rd.y + origin_b.z * Rd.z and c = origin_c
+    Point3D origin_b;
+    double origin_c;
+
 public:
     GeneralObject()
     {
@@ -663,8 +3048,11 @@ public:
         
         double c = gen_obj_coefficients[0] * ray.start.x * ray.start.x + gen_obj_coefficients[1] * ray.start.y * ray.start.y + gen_obj_coefficients[2] * ray.start.z * ray.start.z + gen_obj_coefficients[3] * ray.start.x * ray.start.y + gen_obj_coefficients[4] * ray.start.x * ray.start.z + gen_obj_coefficients[5] * ray.start.y * ray.start.z + gen_obj_coefficients[6] * ray.start.x + gen_obj_coefficients[7] * ray.start.y + gen_obj_coefficients[8] * ray.start.z + gen_obj_coefficients[9];
         
-        //double t = -1.0;
-        
+        return get_root_within_cube(ray, a, b, c);
+    }
+    
+    double get_root_within_cube(const Ray &ray, double a, double b, double c)
+    {
         double D = b * b - 4 * a * c;
         if(D < 0) return -1.0;
         
@@ -685,9 +3073,39 @@ public:
         else return -1.0;
     }
     
+    bool get_bounding_sphere(Point3D &center, double &radius) override
+    {
+        if(length == 0 || width == 0 || height == 0) return false; // not clipped along some dimension
+        
+        center = reference_point + Point3D(length, width, height) * 0.5;
+        radius = 0.5 * sqrt(length * length + width * width + height * height);
+        return true;
+    }
+    
+    void precompute_origin_terms(const Point3D &origin) override
+    {
+        const vector<double> &k = gen_obj_coefficients;
+        
+        origin_b.x = 2 * k[0] * origin.x + k[3] * origin.y + k[4] * origin.z + k[6];
+        origin_b.y = 2 * k[1] * origin.y + k[3] * origin.x + k[5] * origin.z + k[7];
+        origin_b.z = 2 * k[2] * origin.z + k[4] * origin.x + k[5] * origin.y + k[8];
+        
+        origin_c = k[0] * origin.x * origin.x + k[1] * origin.y * origin.y + k[2] * origin.z * origin.z + k[3] * origin.x * origin.y + k[4] * origin.x * origin.z + k[5] * origin.y * origin.z + k[6] * origin.x + k[7] * origin.y + k[8] * origin.z + k[9];
+    }
+    
+    double get_shared_origin_t_value(const Ray &ray) override
+    {
+        const vector<double> &k = gen_obj_coefficients;
+        
+        double a = k[0] * ray.direction.x * ray.direction.x + k[1] * ray.direction.y * ray.direction.y + k[2] * ray.direction.z * ray.direction.z + k[3] * ray.direction.x * ray.direction.y + k[4] * ray.direction.x * ray.direction.z + k[5] * ray.direction.y * ray.direction.z;
+        double b = vector_dot_product(origin_b, ray.direction);
+        
+        return get_root_within_cube(ray, a, b, origin_c);
+    }
+    
     double intersect(const Ray &ray, vector<double> &changed_color, int level) override
     {
-        double t = get_intersection_point_t_value(ray);
+        double t = get_t_value(ray);
 
         if(t <= 0 ) return -1.0;
 
@@ -772,6 +3190,39 @@ public:
         return Point3D(0.0, 0.0, 1.0); //In XY plane normal is Z axis
     }
     
+    void get_surface_color(const Point3D &intersection_point, double surface_color[3]) override
+    {
+        int tile_pixel_x = intersection_point.x - reference_point.x;
+        int tile_pixel_y = intersection_point.y - reference_point.y;
+        
+        int tile_x_index = tile_pixel_x / length;
+        int tile_y_index = tile_pixel_y / length;
+        
+        for (int i = 0; i < 3; i++)
+        {
+            surface_color[i] = (tile_x_index + tile_y_index + 1) % 2; //odd - white tile  even - black tile
+        }
+    }
+    
+    bool get_bounding_sphere(Point3D &center, double &radius) override
+    {
+        center = Point3D(0, 0, reference_point.z);
+        radius = -reference_point.x * sqrt(2.0);
+        return true;
+    }
+    
+    bool get_bounding_box(Point3D &min_corner, Point3D &max_corner) override
+    {
+        min_corner = reference_point;
+        max_corner = Point3D(-reference_point.x, -reference_point.y, reference_point.z);
+        return true;
+    }
+    
+    bool may_shadow_itself(const Point3D &point, const Point3D &light_center, double extent) const override
+    {
+        return false; // flat
+    }
+    
     bool is_within_boundary(const Point3D &point)
     {
         if(point.x < reference_point.x || point.x > -reference_point.x || point.y < reference_point.y || point.y > -reference_point.y)
@@ -801,9 +3252,27 @@ public:
         return t;
     }
     
+    void occlude_packet(const ShadowRayPacket &packet, char occluded[]) override
+    {
+        // get_intersection_point_t_value() without branches, one lane per ray. The divisions get a loop of their own
+        // so that they run on whole vectors. A lane parallel to the floor divides by 0 and is left alone by the direction test
+        double t_values[SHADOW_PACKET_SIZE];
+        
+        for(int k = 0; k < SHADOW_PACKET_SIZE; k++)
+        {
+            t_values[k] = -(packet.start_z[k] / packet.direction_z[k]);
+        }
+        
+        for(int k = 0; k < SHADOW_PACKET_SIZE; k++)
+        {
+            bool hit = packet.direction_z[k] != 0.0 && t_values[k] > 0.0 && t_values[k] <= packet.distance[k];
+            occluded[k] = occluded[k] | hit;
+        }
+    }
+    
     double intersect(const Ray &ray, vector<double> &changed_color, int level) override
     {
-        double t = get_intersection_point_t_value(ray);
+        double t = get_t_value(ray);
         
         Point3D intersecting_vector = ray.start + t * ray.direction;
         
@@ -814,17 +3283,6 @@ public:
 
         if(level == 0) return t; //When level is 0, the purpose of the  method is to determine the nearest object only.
         
-        int tile_pixel_x = intersecting_vector.x - reference_point.x;
-        int tile_pixel_y = intersecting_vector.y - reference_point.y;
-        
-        int tile_x_index = tile_pixel_x / length;
-        int tile_y_index = tile_pixel_y / length;
-        
-        for (int i = 0; i < 3; i++)
-        {
-            color[i] = (tile_x_index + tile_y_index + 1) % 2;
-        }
-        
         coloring_illumination_reflection(this, ray, t, changed_color, level);
         
         return t;
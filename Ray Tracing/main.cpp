@@ -10,6 +10,7 @@
 
 #define WINDOW_HEIGHT 600
 #define WINDOW_WIDTH 600
+#define WINDOW_TITLE "My OpenGL Ray Tracing Program"
 
 #define FOVY 80
 #define ASPECT_RATIO 1
@@ -25,6 +26,19 @@
 //look -- look vector
 Point3D eye_pos, up, rght, look;
 
+// camera the renderer traces with, a copy of the one above taken when a capture starts, so the view can move meanwhile
+struct Camera{
+    Point3D eye_pos, up, rght, look;
+};
+
+Camera render_camera;
+
+Camera get_current_camera()
+{
+    Camera camera = {eye_pos, up, rght, look};
+    return camera;
+}
+
 double cameraHeight;
 double cameraAngle;
 int drawaxes;
@@ -36,6 +50,48 @@ extern int level_of_recursion;
 int image_height, image_width;
 int num_of_objects;
 int num_of_light_sources;
+bool wavefront_rendering = false; // 'w' toggles between recursive and wavefront reflection tracing, --wavefront selects the latter
+double light_influence_radius = 0.0; // --light-radius, 0 keeps the lights unattenuated
+int light_sampling_passes = 16; // --light-passes, passes averaged when lights are sampled
+
+// progressive mode ('p' toggles): jittered passes are averaged until every region of the image of a pass is
+// within progressive_target_psnr of the previous one or progressive_time_budget seconds have passed
+bool progressive_rendering = false;
+double progressive_target_psnr = 45.0; // --target-psnr, dB
+double progressive_time_budget = 600.0; // --time-budget, seconds
+int progressive_max_passes = 1024;
+
+// order in which trace_frame() visits the pixels, 'o' cycles, --pixel-order selects
+enum PixelOrder { ORDER_ROW_MAJOR, ORDER_MORTON, ORDER_HILBERT, NUM_OF_PIXEL_ORDERS };
+int pixel_order = ORDER_ROW_MAJOR; // the curves pay off when the scene does not fit into the cache
+bool benchmark_only = false; // --benchmark-order runs benchmark_pixel_orders() and exits
+
+// output stage, see tonemap_to_image()
+enum ToneMapping { TONEMAP_CLAMP, TONEMAP_REINHARD, TONEMAP_ACES, NUM_OF_TONEMAPS };
+int tone_mapping = TONEMAP_CLAMP; // 'm' cycles, --tonemap selects
+float output_exposure = 1.0f; // --exposure, scales the linear colors before tone mapping
+float output_gamma = 1.0f; // --gamma, 1 writes the linear values
+vector<float> framebuffer; // linear RGB (HDR, unclamped) of the last capture, row major
+bool streaming_capture = false; // --stream, renders and writes STREAMING_BAND_ROWS rows at a time without a full frame
+int image_size_override = 0; // --image-size, replaces the pixel count of scene.txt
+string checkpoint_file_name = "1605084_ray_tracing.checkpoint";
+double checkpoint_interval = 60.0; // --checkpoint-interval, seconds between checkpoints, 0 disables them
+bool resume_capture = false; // --resume continues from the checkpoint of an interrupted capture
+
+// rectangle of pixels, x and y of the top left one
+struct PixelWindow{
+    int x, y, width, height;
+};
+
+PixelWindow crop_window = {0, 0, 0, 0}; // --crop x y width height, a width of 0 captures the whole frame
+string crop_target_file; // --crop-into, image the crop window is composited into
+bool numa_scaling_only = false; // --numa-scaling runs report_numa_scaling() and exits
+bool memory_benchmark_only = false; // --memory-benchmark runs benchmark_memory_caps() and exits
+bool capture_only = false; // --capture runs render_capture() without a window and exits
+bool self_test_only = false; // --self-test runs run_self_test() and exits, with status 1 when a path fails
+
+// progress of the capture running in the background, see request_capture()
+atomic<int> capture_steps_done(0), capture_steps_total(0); // bands or passes, for the progress in the window title
 
 extern vector<Object*> objects;
 extern vector<Light> lights;
@@ -43,146 +99,2203 @@ extern vector<Light> lights;
 
 using namespace std;
 
-/* **************** OPENGL Functions ****************** */
-void drawAxes()
+/* **************** OPENGL Functions ****************** */
+void drawAxes()
+{
+    if(drawaxes == 1)
+    {
+        glBegin(GL_LINES);
+        {
+            //X - axis -- RED
+            glColor3f(1.0, 0, 0);
+            glVertex3f(150, 0, 0);
+            glVertex3f(-150, 0, 0);
+
+            //Y - axis --GREEN
+            glColor3f(0, 1, 0);
+            glVertex3f(0, -150, 0);
+            glVertex3f(0, 150, 0);
+
+            //Z - axis -- BLUE
+            glColor3f(0, 0, 1);
+            glVertex3f(0, 0, 150);
+            glVertex3f(0, 0, -150);
+        }
+        glEnd();
+    }
+}
+
+void look_left(double angle)
+{
+    //up fixed
+    look = look * cos(angle) + vector_cross_product(up, look) * sin(angle);
+    rght = rght * cos(angle) + vector_cross_product(up, rght) * sin(angle);
+}
+
+void look_right(double angle)
+{
+    look_left(-angle);
+}
+
+void look_up(double angle)
+{
+    //right fixed
+    up = up * cos(angle) + vector_cross_product(rght, up) * sin(angle);
+    look = look * cos(angle) + vector_cross_product(rght, look) * sin(angle);
+}
+
+void look_down(double angle)
+{
+    look_up(-angle);
+}
+
+void tilt_anticlockwise(double angle)
+{
+    //look fixed
+    up = up * cos(angle) + vector_cross_product(look, up) * sin(angle);
+    rght = rght * cos(angle) + vector_cross_product(look, rght) * sin(angle);
+}
+
+void tilt_clockwise(double angle)
+{
+    tilt_anticlockwise(-angle);
+}
+
+double degreeToRadianAngle(double degree)
+{
+    return pi / 180 * degree;
+}
+
+// traces the primary ray through pixel_position (a point on the image plane), returns the index of the object it hit or -1
+int trace_primary_sample(const Point3D &pixel_position, double color[3])
+{
+    thread_local vector<double> dummy_color(3); // reused by every sample of the thread
+    dummy_color.assign(3, 0.0);
+    
+    //cast ray from eye to (curPixel-eye) direction
+    Ray ray(render_camera.eye_pos, pixel_position - render_camera.eye_pos);
+    ray.from_shared_origin = true;
+    
+    double t_min;
+    int nearest = find_nearest_object(ray, t_min); //stores the nearest object index
+    
+    if(nearest != -1)
+    {
+        t_min = objects[nearest]->intersect(ray, dummy_color, 1);
+    }
+    
+    for(int x = 0; x < 3; x++)
+    {
+        color[x] = dummy_color[x];
+    }
+    return nearest;
+}
+
+/*
+ Pixel traversal. With --pixel-order morton or hilbert, pixels are visited tile by tile, the tiles and the
+ pixels inside a tile both following a Z-order (Morton) or Hilbert curve, so consecutive rays hit nearby
+ geometry and lights. Each thread of the parallel pass receives one contiguous run of the curve, that is a
+ compact region of the image. Row major stays the default, small scenes fit into the cache either way and
+ the sort is not free; benchmark_pixel_orders() compares them.
+ */
+#define TRAVERSAL_TILE_SIZE 16 // power of two
+
+// interleaves the bits of x and y
+unsigned long long get_morton_index(unsigned int x, unsigned int y)
+{
+    unsigned long long index = 0;
+    
+    for(int bit = 0; bit < 32; bit++)
+    {
+        index |= (unsigned long long) ((x >> bit) & 1) << (2 * bit);
+        index |= (unsigned long long) ((y >> bit) & 1) << (2 * bit + 1);
+    }
+    return index;
+}
+
+// distance of (x, y) along the Hilbert curve filling an n x n grid, n a power of two
+unsigned long long get_hilbert_index(unsigned int n, unsigned int x, unsigned int y)
+{
+    unsigned long long index = 0;
+    
+    for(unsigned int s = n / 2; s > 0; s /= 2)
+    {
+        unsigned int rx = (x & s) > 0, ry = (y & s) > 0;
+        index += (unsigned long long) s * s * ((3 * rx) ^ ry);
+        
+        // rotate the quadrant so the curve continues
+        if(ry == 0)
+        {
+            if(rx == 1)
+            {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            swap(x, y);
+        }
+    }
+    return index;
+}
+
+// position of (x, y) along the curve of order filling an n x n grid, n a power of two
+unsigned long long get_curve_index(int order, unsigned int n, unsigned int x, unsigned int y)
+{
+    return order == ORDER_MORTON ? get_morton_index(x, y) : get_hilbert_index(n, x, y);
+}
+
+// the pixels (row major indices) sorted along the traversal curve. Only the tiles of the rows the pixels cover
+// are ranked, and the pixels go through two counting sorts, by their position inside the tile and then (stable)
+// by the rank of their tile, so a band costs time and memory in its own size, not the frame's
+vector<int> get_traversal_order(const vector<int> &pixels, int order)
+{
+    if(order == ORDER_ROW_MAJOR || pixels.empty()) return pixels;
+    
+    const int tile_pixels = TRAVERSAL_TILE_SIZE * TRAVERSAL_TILE_SIZE;
+    int tiles_x = (image_width + TRAVERSAL_TILE_SIZE - 1) / TRAVERSAL_TILE_SIZE;
+    int tiles_y = (image_height + TRAVERSAL_TILE_SIZE - 1) / TRAVERSAL_TILE_SIZE;
+    unsigned int curve_size = 1;
+    while(curve_size < (unsigned int) tiles_x || curve_size < (unsigned int) tiles_y) curve_size *= 2;
+    
+    int first_tile_row = tiles_y, last_tile_row = 0;
+    for(size_t k = 0; k < pixels.size(); k++)
+    {
+        int tile_row = pixels[k] / image_width / TRAVERSAL_TILE_SIZE;
+        first_tile_row = min(first_tile_row, tile_row);
+        last_tile_row = max(last_tile_row, tile_row);
+    }
+    
+    // rank of every covered tile along the curve
+    int num_of_tiles = tiles_x * (last_tile_row - first_tile_row + 1);
+    vector<pair<unsigned long long, int> > tile_keys(num_of_tiles);
+    vector<int> tile_ranks(num_of_tiles);
+    
+    for(int t = 0; t < num_of_tiles; t++)
+    {
+        tile_keys[t] = make_pair(get_curve_index(order, curve_size, t % tiles_x, first_tile_row + t / tiles_x), t);
+    }
+    sort(tile_keys.begin(), tile_keys.end());
+    for(int r = 0; r < num_of_tiles; r++)
+    {
+        tile_ranks[tile_keys[r].second] = r;
+    }
+    
+    // position of every pixel of a tile along the curve, the same in every tile
+    int in_tile_ranks[tile_pixels];
+    for(int y = 0; y < TRAVERSAL_TILE_SIZE; y++)
+    {
+        for(int x = 0; x < TRAVERSAL_TILE_SIZE; x++)
+        {
+            in_tile_ranks[y * TRAVERSAL_TILE_SIZE + x] = (int) get_curve_index(order, TRAVERSAL_TILE_SIZE, x, y);
+        }
+    }
+    
+    auto get_in_tile_rank = [&](int pixel) {
+        int i = pixel / image_width, j = pixel % image_width;
+        return in_tile_ranks[(i % TRAVERSAL_TILE_SIZE) * TRAVERSAL_TILE_SIZE + j % TRAVERSAL_TILE_SIZE];
+    };
+    auto get_tile_rank = [&](int pixel) {
+        int i = pixel / image_width, j = pixel % image_width;
+        return tile_ranks[(i / TRAVERSAL_TILE_SIZE - first_tile_row) * tiles_x + j / TRAVERSAL_TILE_SIZE];
+    };
+    
+    vector<int> by_position(pixels.size()), ordered_pixels(pixels.size());
+    vector<int> counts(tile_pixels + 1, 0);
+    
+    for(size_t k = 0; k < pixels.size(); k++) counts[get_in_tile_rank(pixels[k]) + 1]++;
+    for(int r = 0; r < tile_pixels; r++) counts[r + 1] += counts[r];
+    for(size_t k = 0; k < pixels.size(); k++) by_position[counts[get_in_tile_rank(pixels[k])]++] = pixels[k];
+    
+    counts.assign(num_of_tiles + 1, 0);
+    for(size_t k = 0; k < by_position.size(); k++) counts[get_tile_rank(by_position[k]) + 1]++;
+    for(int r = 0; r < num_of_tiles; r++) counts[r + 1] += counts[r];
+    for(size_t k = 0; k < by_position.size(); k++) ordered_pixels[counts[get_tile_rank(by_position[k])]++] = by_position[k];
+    
+    return ordered_pixels;
+}
+
+const char *get_pixel_order_name(int order)
+{
+    const char *names[NUM_OF_PIXEL_ORDERS] = {"row major", "morton", "hilbert"};
+    
+    return names[order];
+}
+
+/*
+ Private results of one worker. A worker traces its run of pixels into its own buffer, whose colors start
+ on a cache line, and copies the finished run into the frame in one go. No cache line of the frame is
+ written by two threads while tracing, and the buffer is allocated by the worker, so in NUMA mode it sits
+ on the worker's node.
+ */
+#define CACHE_LINE_SIZE 64
+
+struct TileBuffer{
+    vector<float> storage;
+    float *colors; // 3 per pixel, CACHE_LINE_SIZE aligned inside storage
+    vector<int> hit_objects;
+    char padding[CACHE_LINE_SIZE]; // keeps the fields of neighbouring workers apart
+    
+    TileBuffer()
+    {
+        colors = nullptr;
+    }
+    
+    void reserve(int num_of_pixels)
+    {
+        if(hit_objects.size() >= (size_t) num_of_pixels) return;
+        
+        storage.resize(3 * num_of_pixels + CACHE_LINE_SIZE / sizeof(float));
+        size_t address = (size_t) storage.data();
+        colors = (float *) ((address + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE);
+        hit_objects.resize(num_of_pixels);
+    }
+};
+
+// traces one sample through each pixel in pixels (its center, or a point in it from the sampler when jitter is set),
+// sample_counts holds the sample index of every pixel. pixel_colors receives linear RGB (unclamped) in row major order and
+// hit_objects the object each ray hit. Other pixels are set to black and to -1 (no hit), nothing is kept from an earlier
+// call. The buffers cover num_of_rows rows from first_row (all rows by default), every pixel index must fall into them.
+void trace_frame(const Point3D &top_left, double du, double dv, bool jitter, const vector<int> &frame_pixels, const vector<int> &sample_counts, vector<float> &pixel_colors, vector<int> &hit_objects, int first_row = 0, int num_of_rows = -1)
+{
+    vector<int> pixels = get_traversal_order(frame_pixels, pixel_order);
+    int num_of_pixels = (int) pixels.size();
+    int first_pixel = first_row * image_width;
+    if(num_of_rows < 0) num_of_rows = image_height - first_row;
+    
+    pixel_colors.assign(3 * image_width * num_of_rows, 0.0);
+    hit_objects.assign(image_width * num_of_rows, -1);
+    
+    if(wavefront_rendering)
+    {
+        vector<Ray> primary_rays(num_of_pixels);
+        vector<SampleState> primary_samples(num_of_pixels);
+        vector<double> ray_colors;
+        vector<int> ray_hits;
+        
+        for(int k = 0; k < num_of_pixels; k++)
+        {
+            int i = pixels[k] / image_width, j = pixels[k] % image_width;
+            start_pixel_sample(j, i, sample_counts[pixels[k] - first_pixel]);
+            double offset_u = jitter ? get_next_sample() - 0.5 : 0.0;
+            double offset_v = jitter ? get_next_sample() - 0.5 : 0.0;
+            Point3D current_pixel = top_left + render_camera.rght * ((j + offset_u) * du) - render_camera.up * ((i + offset_v) * dv);
+            
+            primary_rays[k] = Ray(render_camera.eye_pos, current_pixel - render_camera.eye_pos);
+            primary_rays[k].from_shared_origin = true;
+            primary_samples[k] = sample_state;
+        }
+        
+        render_wavefront(primary_rays, ray_colors, &ray_hits, &primary_samples);
+        
+        for(int k = 0; k < num_of_pixels; k++)
+        {
+            for(int x = 0; x < 3; x++)
+            {
+                pixel_colors[3 * (pixels[k] - first_pixel) + x] = (float) ray_colors[3 * k + x];
+            }
+            hit_objects[pixels[k] - first_pixel] = ray_hits[k];
+        }
+        return;
+    }
+    
+    auto trace_pixel = [&](int pixel, double color[3]) {
+        int i = pixel / image_width, j = pixel % image_width;
+        start_pixel_sample(j, i, sample_counts[pixel - first_pixel]);
+        double offset_u = jitter ? get_next_sample() - 0.5 : 0.0;
+        double offset_v = jitter ? get_next_sample() - 0.5 : 0.0;
+        Point3D current_pixel = top_left + render_camera.rght * ((j + offset_u) * du) - render_camera.up * ((i + offset_v) * dv);
+        
+        return trace_primary_sample(current_pixel, color);
+    };
+    
+    vector<TileBuffer> tile_buffers(get_num_of_worker_threads());
+    
+    parallel_for_dynamic(num_of_pixels, TRAVERSAL_TILE_SIZE * TRAVERSAL_TILE_SIZE, [&](int begin, int end) {
+        if(is_render_cancelled()) return; // the frame is thrown away
+        
+        TileBuffer &tile = tile_buffers[current_worker_id];
+        tile.reserve(end - begin);
+        
+        for(int k = begin; k < end; k++)
+        {
+            double color[3];
+            
+            tile.hit_objects[k - begin] = trace_pixel(pixels[k], color);
+            for(int x = 0; x < 3; x++)
+            {
+                tile.colors[3 * (k - begin) + x] = (float) color[x];
+            }
+        }
+        
+        // flush the finished run
+        for(int k = begin; k < end; k++)
+        {
+            float *frame_color = &pixel_colors[3 * (pixels[k] - first_pixel)];
+            const float *tile_color = &tile.colors[3 * (k - begin)];
+            
+            frame_color[0] = tile_color[0];
+            frame_color[1] = tile_color[1];
+            frame_color[2] = tile_color[2];
+            hit_objects[pixels[k] - first_pixel] = tile.hit_objects[k - begin];
+        }
+    });
+}
+
+/*
+ Region adaptive sampling for progressive mode, the same quadrant recursion as hierarchical_psnr() in
+ bitmap_image.hpp: the images of two passes are split into quadrants down to CHANGING_REGION_SIZE pixels
+ and the regions whose PSNR is still below the target receive the samples of the next pass.
+ */
+#define CHANGING_REGION_SIZE 8
+
+void find_changing_regions(unsigned int x, unsigned int y, unsigned int width, unsigned int height, const bitmap_image &image1, const bitmap_image &image2, double threshold, vector<int> &pixels)
+{
+    if(width == 0 || height == 0) return;
+    
+    if(width <= CHANGING_REGION_SIZE || height <= CHANGING_REGION_SIZE)
+    {
+        if(psnr_region(x, y, width, height, image1, image2) >= threshold) return;
+        
+        for(unsigned int row = y; row < y + height; row++)
+        {
+            for(unsigned int col = x; col < x + width; col++)
+            {
+                pixels.push_back(row * image_width + col);
+            }
+        }
+        return;
+    }
+    
+    unsigned int half_width = width / 2, half_height = height / 2;
+    
+    find_changing_regions(x, y, half_width, half_height, image1, image2, threshold, pixels);
+    find_changing_regions(x + half_width, y, width - half_width, half_height, image1, image2, threshold, pixels);
+    find_changing_regions(x + half_width, y + half_height, width - half_width, height - half_height, image1, image2, threshold, pixels);
+    find_changing_regions(x, y + half_height, half_width, height - half_height, image1, image2, threshold, pixels);
+}
+
+// one progressive pass over pixels: adds a jittered sample to accumulated_colors and records its hit in frame_hits.
+// The pass traces into buffers of its own, so convergence only sees the accumulated colors and sample_counts
+void trace_progressive_pass(const Point3D &top_left, double du, double dv, const vector<int> &pixels, vector<int> &sample_counts, vector<float> &accumulated_colors, vector<int> &frame_hits)
+{
+    vector<float> pass_colors;
+    vector<int> pass_hits;
+    
+    trace_frame(top_left, du, dv, true, pixels, sample_counts, pass_colors, pass_hits);
+    
+    for(int k = 0; k < (int) pixels.size(); k++)
+    {
+        for(int x = 0; x < 3; x++)
+        {
+            accumulated_colors[3 * pixels[k] + x] += pass_colors[3 * pixels[k] + x];
+        }
+        frame_hits[pixels[k]] = pass_hits[pixels[k]];
+        sample_counts[pixels[k]]++;
+    }
+}
+
+/*
+ Adaptive supersampling: only pixels whose color or hit object differs from a neighbour are refined.
+ A refined pixel is split into 2x2 sub-pixels with one ray each, and every sub-pixel whose sample differs
+ from the others is split again, down to MAX_SUPERSAMPLING_DEPTH levels (4x4 at depth 2).
+ */
+#define MAX_SUPERSAMPLING_DEPTH 2
+
+bool adaptive_supersampling = false; // 'a' toggles
+double supersampling_threshold = 0.1; // largest color difference (per channel, in [0, 1]) that is left alone
+
+template<typename Color>
+double get_color_difference(const Color *a, const Color *b)
+{
+    double difference = 0.0;
+    for(int x = 0; x < 3; x++)
+    {
+        difference = max(difference, fabs(min(1.0, max(0.0, (double) a[x])) - min(1.0, max(0.0, (double) b[x]))));
+    }
+    return difference;
+}
+
+// average color of the square around center with half size (half_du, half_dv), returns the number of rays traced
+long long sample_pixel_region(const Point3D &center, double half_du, double half_dv, int depth, double color[3])
+{
+    double sub_colors[4][3];
+    int sub_hits[4];
+    Point3D sub_centers[4];
+    long long num_of_rays = 4;
+    
+    for(int k = 0; k < 4; k++)
+    {
+        double offset_u = (k % 2 == 0 ? -0.5 : 0.5) * half_du;
+        double offset_v = (k / 2 == 0 ? -0.5 : 0.5) * half_dv;
+        
+        sub_centers[k] = center + render_camera.rght * offset_u - render_camera.up * offset_v;
+        sub_hits[k] = trace_primary_sample(sub_centers[k], sub_colors[k]);
+    }
+    
+    for(int k = 0; k < 4 && depth < MAX_SUPERSAMPLING_DEPTH; k++)
+    {
+        bool is_different = false;
+        for(int other = 0; other < 4; other++)
+        {
+            is_different = is_different || sub_hits[k] != sub_hits[other] || get_color_difference(sub_colors[k], sub_colors[other]) > supersampling_threshold;
+        }
+        
+        if(is_different) num_of_rays += sample_pixel_region(sub_centers[k], 0.5 * half_du, 0.5 * half_dv, depth + 1, sub_colors[k]);
+    }
+    
+    for(int x = 0; x < 3; x++)
+    {
+        color[x] = (sub_colors[0][x] + sub_colors[1][x] + sub_colors[2][x] + sub_colors[3][x]) / 4;
+    }
+    return num_of_rays;
+}
+
+// replaces the colors of the pixels that differ from a neighbour with adaptive supersamples, returns the number of rays traced.
+// sample_index is the sampler index the supersamples of every pixel use
+// Only the pixels of window are refined when it is given. The buffers then hold the rows from first_row on,
+// which have to include the neighbours of the window inside the image.
+long long refine_pixel_edges(const Point3D &top_left, double du, double dv, int sample_index, vector<float> &pixel_colors, const vector<int> &hit_objects, const PixelWindow *window = nullptr, int first_row = 0)
+{
+    PixelWindow frame = {0, 0, image_width, image_height};
+    if(window == nullptr) window = &frame;
+    
+    int first_pixel = first_row * image_width;
+    vector<int> refined_pixels;
+    
+    for(int i = window->y; i < window->y + window->height; i++)
+    {
+        for(int j = window->x; j < window->x + window->width; j++)
+        {
+            int pixel = i * image_width + j - first_pixel;
+            bool is_edge = false;
+            int neighbours[4][2] = {{i - 1, j}, {i + 1, j}, {i, j - 1}, {i, j + 1}};
+            
+            for(int k = 0; k < 4 && !is_edge; k++)
+            {
+                int row = neighbours[k][0], col = neighbours[k][1];
+                
+                if(row < 0 || row >= image_height || col < 0 || col >= image_width) continue;
+                
+                int neighbour = row * image_width + col - first_pixel;
+                is_edge = hit_objects[pixel] != hit_objects[neighbour] || get_color_difference(&pixel_colors[3 * pixel], &pixel_colors[3 * neighbour]) > supersampling_threshold;
+            }
+            
+            if(is_edge) refined_pixels.push_back(pixel);
+        }
+    }
+    
+    vector<double> refined_colors(3 * refined_pixels.size());
+    vector<long long> rays_per_pixel(refined_pixels.size());
+    
+    parallel_for_dynamic((int) refined_pixels.size(), TRAVERSAL_TILE_SIZE, [&](int begin, int end) {
+        if(is_render_cancelled()) return;
+        
+        for(int k = begin; k < end; k++)
+        {
+            int i = (refined_pixels[k] + first_pixel) / image_width, j = refined_pixels[k] % image_width;
+            Point3D center = top_left + render_camera.rght * (j * du) - render_camera.up * (i * dv);
+            
+            start_pixel_sample(j, i, sample_index);
+            rays_per_pixel[k] = sample_pixel_region(center, 0.5 * du, 0.5 * dv, 1, &refined_colors[3 * k]);
+        }
+    });
+    
+    long long num_of_rays = 0;
+    for(int k = 0; k < (int) refined_pixels.size(); k++)
+    {
+        for(int x = 0; x < 3; x++)
+        {
+            pixel_colors[3 * refined_pixels[k] + x] = (float) refined_colors[3 * k + x];
+        }
+        num_of_rays += rays_per_pixel[k];
+    }
+    return num_of_rays;
+}
+
+/*
+ Output stage. The renderer works in linear float RGB, values above 1 included, and tonemap_to_image()
+ turns it into the BGR bytes of the bitmap one row at a time: exposure and tone mapping (clamp, Reinhard
+ or the ACES filmic fit), gamma through a lookup table, quantization and packing. Each step is its own
+ branch free loop over a whole row of floats so that the compiler vectorizes it; only the gamma lookup
+ (a gather) and the red/blue swap of the packed bytes stay scalar.
+ */
+#define GAMMA_TABLE_SIZE 4096
+
+// num_of_rows rows of linear colors (3 floats per pixel) to BGR rows of row_stride bytes starting at bgr_rows
+void tonemap_rows(const float *colors, int num_of_rows, unsigned char *bgr_rows, size_t row_stride)
+{
+    int row_size = 3 * image_width;
+    float exposure = output_exposure;
+    int mapping = tone_mapping;
+    float gamma = output_gamma;
+    
+    // built again only when --gamma changes, the workers read a copy
+    static mutex gamma_table_mutex;
+    static vector<float> gamma_table;
+    static float gamma_table_exponent = 0.0f;
+    vector<float> gamma_values;
+    
+    if(gamma != 1.0f)
+    {
+        lock_guard<mutex> lock(gamma_table_mutex);
+        
+        if(gamma_table_exponent != gamma)
+        {
+            gamma_table.resize(GAMMA_TABLE_SIZE);
+            for(int k = 0; k < GAMMA_TABLE_SIZE; k++)
+            {
+                gamma_table[k] = (float) pow((double) k / (GAMMA_TABLE_SIZE - 1), 1.0 / gamma);
+            }
+            gamma_table_exponent = gamma;
+        }
+        gamma_values = gamma_table;
+    }
+    
+    parallel_for(num_of_rows, [&](int begin, int end) {
+        int n = row_size; // a local, the byte stores below could alias a captured one and keep the loops scalar
+        vector<float> values(n);
+        const float *gamma_lookup = gamma_values.data();
+        
+        for(int i = begin; i < end; i++)
+        {
+            const float *row_colors = colors + (size_t) i * n;
+            unsigned char *row = bgr_rows + i * row_stride;
+            
+            // tone map to [0, 1]
+            if(mapping == TONEMAP_CLAMP)
+            {
+                //Clip the color values so that they are in [0, 1] range.
+                for(int k = 0; k < n; k++)
+                {
+                    values[k] = min(1.0f, max(0.0f, row_colors[k] * exposure));
+                }
+            }
+            else
+            {
+                // the curves get a loop of their own, the clamp before the division keeps it from vectorizing
+                for(int k = 0; k < n; k++)
+                {
+                    values[k] = max(0.0f, row_colors[k] * exposure);
+                }
+                
+                if(mapping == TONEMAP_REINHARD)
+                {
+                    for(int k = 0; k < n; k++)
+                    {
+                        values[k] = values[k] / (1.0f + values[k]);
+                    }
+                }
+                else
+                {
+                    for(int k = 0; k < n; k++)
+                    {
+                        float v = values[k];
+                        values[k] = min(1.0f, (v * (2.51f * v + 0.03f)) / (v * (2.43f * v + 0.59f) + 0.14f));
+                    }
+                }
+            }
+            
+            if(gamma != 1.0f)
+            {
+                for(int k = 0; k < n; k++)
+                {
+                    values[k] = gamma_lookup[(int) (values[k] * (GAMMA_TABLE_SIZE - 1) + 0.5f)];
+                }
+            }
+            
+            // quantize as red, green, blue, then swap red and blue in place
+            for(int k = 0; k < n; k++)
+            {
+                row[k] = (unsigned char) (int) (values[k] * 255.0);
+            }
+            for(int k = 0; k < n; k += 3)
+            {
+                swap(row[k], row[k + 2]);
+            }
+        }
+    });
+}
+
+void tonemap_to_image(const vector<float> &colors, bitmap_image &image)
+{
+    tonemap_rows(colors.data(), image_height, image.row(0), (size_t) image.bytes_per_pixel() * image_width);
+}
+
+const char *get_tone_mapping_name()
+{
+    const char *names[NUM_OF_TONEMAPS] = {"clamp", "reinhard", "aces"};
+    
+    return names[tone_mapping];
+}
+
+// sets up the image plane of the current camera and the per frame acceleration data, top_left receives the center of pixel (0, 0)
+void prepare_frame(Point3D &top_left, double &du, double &dv)
+{
+    double plane_distance = (WINDOW_HEIGHT / 2.0) / tan(degreeToRadianAngle(FOVY / 2.0));
+    top_left = render_camera.eye_pos + render_camera.look * plane_distance - render_camera.rght * (WINDOW_WIDTH / 2.0) + render_camera.up * (WINDOW_HEIGHT / 2.0);
+    du = (double) WINDOW_WIDTH / image_width;
+    dv = (double) WINDOW_HEIGHT / image_height;
+
+    // Choose middle of the grid cell
+    top_left = top_left + render_camera.rght * (0.5 * du) - render_camera.up * (0.5 * dv);
+    
+    // every primary ray starts at the eye, so the origin terms are computed once per frame
+    for(int k = 0; k < (int) objects.size(); k++)
+    {
+        objects[k]->precompute_origin_terms(render_camera.eye_pos);
+    }
+    
+    build_light_occluder_grids();
+    build_light_clusters();
+    build_light_alias_table();
+    update_max_radiance_bound();
+}
+
+/*
+ Streaming output for images too large to keep in memory. The BMP header goes out first, then the
+ frame is rendered in bands of STREAMING_BAND_ROWS rows starting at the bottom, which is the order a
+ BMP stores its rows in, so every band is appended right after the previous one. Memory stays at a
+ few bands of floats and bytes whatever the image size. Under --memory-cap the bands get shorter until
+ STREAMING_BYTES_PER_PIXEL of a band fits in a quarter of the cap, the rest is left for the scene.
+ */
+#define STREAMING_BAND_ROWS 64
+#define STREAMING_BYTES_PER_PIXEL 48 // band colors, accumulation, counts, hits, pixel list and output bytes
+
+size_t streaming_peak_resident_memory = 0; // largest resident memory seen after a band of the last streamed capture
+
+class StreamingBitmapWriter{
+
+    ofstream stream;
+    unsigned int width, height;
+    unsigned int row_size; // bytes of a row in the file, padded to 4
+
+    void write_value(unsigned int value, int num_of_bytes)
+    {
+        for(int k = 0; k < num_of_bytes; k++)
+        {
+            stream.put((char) ((value >> (8 * k)) & 0xFF)); // little endian
+        }
+    }
+
+public:
+    // writes the header, same fields as bitmap_image::save_image(). With is_resumed the bands already in the file are kept
+    bool open(const string &file_name, unsigned int width, unsigned int height, bool is_resumed = false)
+    {
+        this->width = width;
+        this->height = height;
+        this->row_size = (3 * width + 3) & ~3u;
+        stream.open(file_name.c_str(), is_resumed ? ios::binary | ios::in | ios::out : ios::binary);
+        
+        if(!stream)
+        {
+            cout << "StreamingBitmapWriter: could not open " << file_name << " for writing" << endl;
+            return false;
+        }
+        
+        if(is_resumed) return true;
+        
+        unsigned int size_image = row_size * height;
+        
+        // file header
+        write_value(19778, 2); // "BM"
+        write_value(55 + size_image, 4);
+        write_value(0, 2);
+        write_value(0, 2);
+        write_value(54, 4); // offset of the pixel data
+        
+        // information header
+        write_value(40, 4);
+        write_value(width, 4);
+        write_value(height, 4);
+        write_value(1, 2); // planes
+        write_value(24, 2); // bits per pixel
+        write_value(0, 4); // no compression
+        write_value(size_image, 4);
+        write_value(0, 4);
+        write_value(0, 4);
+        write_value(0, 4);
+        write_value(0, 4);
+        return true;
+    }
+    
+    // true when file_name is a streamed bitmap of width x height that holds every row from first_row down to the bottom
+    static bool has_rows(const string &file_name, unsigned int width, unsigned int height, unsigned int first_row)
+    {
+        ifstream file(file_name.c_str(), ios::binary | ios::ate);
+        unsigned char header[54];
+        
+        if(!file) return false;
+        
+        unsigned long long file_size = (unsigned long long) file.tellg();
+        file.seekg(0);
+        if(!file.read((char *) header, sizeof(header))) return false;
+        
+        auto read_value = [&](int offset, int num_of_bytes) {
+            unsigned int value = 0;
+            for(int k = num_of_bytes - 1; k >= 0; k--) value = (value << 8) | header[offset + k];
+            return value;
+        };
+        
+        unsigned int row_size = (3 * width + 3) & ~3u;
+        
+        return read_value(0, 2) == 19778 && read_value(10, 4) == 54 && read_value(18, 4) == width && read_value(22, 4) == height
+            && read_value(28, 2) == 24 && file_size >= 54 + (unsigned long long) row_size * (height - first_row);
+    }
+    
+    // bgr_rows holds num_of_rows rows of 3 * width bytes (top to bottom) starting at image row first_row
+    void write_band(unsigned int first_row, unsigned int num_of_rows, const unsigned char *bgr_rows)
+    {
+        const char padding[4] = {0, 0, 0, 0};
+        
+        for(int k = (int) num_of_rows - 1; k >= 0; k--)
+        {
+            unsigned long long offset = 54 + (unsigned long long) row_size * (height - 1 - (first_row + k));
+            
+            if((unsigned long long) stream.tellp() != offset) stream.seekp(offset); // only when bands arrive out of order
+            stream.write((const char *) (bgr_rows + (size_t) k * 3 * width), 3 * width);
+            stream.write(padding, row_size - 3 * width);
+        }
+    }
+    
+    // the bands written so far are on disk afterwards
+    void flush()
+    {
+        stream.flush();
+    }
+    
+    void close()
+    {
+        stream.close();
+    }
+};
+
+// moves the triangle vertices into geometry_page_file, once. The other objects have no arrays worth paging
+void page_out_geometry()
+{
+    if(geometry_page_file.size() > 0 || !geometry_page_file.reset()) return;
+    
+    for(int i = 0; i < (int) objects.size(); i++)
+    {
+        objects[i]->triangle_end_points.page_out(geometry_page_file);
+    }
+    if(!geometry_page_file.map()) return;
+    
+    for(int i = 0; i < (int) objects.size(); i++)
+    {
+        objects[i]->triangle_end_points.attach(geometry_page_file);
+    }
+}
+
+// averages num_of_passes passes over rows [first_row, first_row + num_of_rows) into band_colors,
+// only columns [first_column, first_column + num_of_columns) are traced when num_of_columns is given
+long long trace_band(const Point3D &top_left, double du, double dv, int first_row, int num_of_rows, int num_of_passes, vector<float> &band_colors, vector<int> &band_hits, int first_column = 0, int num_of_columns = -1)
+{
+    if(num_of_columns < 0) num_of_columns = image_width - first_column;
+    
+    int num_of_pixels = num_of_rows * image_width;
+    vector<int> band_pixels, sample_counts(num_of_pixels, 0);
+    vector<float> pass_colors;
+    
+    for(int i = first_row; i < first_row + num_of_rows; i++)
+    {
+        for(int j = first_column; j < first_column + num_of_columns; j++)
+        {
+            band_pixels.push_back(i * image_width + j);
+        }
+    }
+    band_colors.assign(3 * num_of_pixels, 0.0f);
+    
+    for(int pass = 0; pass < num_of_passes; pass++)
+    {
+        trace_frame(top_left, du, dv, false, band_pixels, sample_counts, pass_colors, band_hits, first_row, num_of_rows);
+        
+        for(int k = 0; k < 3 * num_of_pixels; k++)
+        {
+            band_colors[k] += pass_colors[k];
+        }
+        for(int k = 0; k < num_of_pixels; k++)
+        {
+            sample_counts[k]++;
+        }
+    }
+    
+    for(int k = 0; k < 3 * num_of_pixels; k++)
+    {
+        band_colors[k] /= num_of_passes;
+    }
+    return (long long) num_of_passes * band_pixels.size();
+}
+
+/*
+ Checkpoints let a long capture survive being killed. The frame is traced band by band and every
+ checkpoint_interval seconds the bands finished since the last checkpoint are added to checkpoint_file_name:
+ their averaged colors and hit objects go to their place in the file and then the band bitmap marks them
+ (a streaming capture has its bands in the output file already, its checkpoint is just the header and the
+ bitmap). --resume reads it back and traces only the missing bands, provided the hash of the scene,
+ the camera and the settings that change the colors still matches. A finished capture deletes it.
+ */
+#define CHECKPOINT_MAGIC 0x4b435452 // "RTCK"
+#define CHECKPOINT_VERSION 2
+
+struct Checkpoint{
+    unsigned long long scene_hash;
+    int band_rows;
+    vector<char> completed_bands;
+    vector<float> colors; // 3 per pixel of the frame, empty for streaming captures
+    vector<int> hit_objects;
+    vector<char> saved_bands; // completed bands whose pixels are in the file already
+    fstream file; // open from the first save (or the load) to the end of the capture
+};
+
+// FNV-1a
+void hash_bytes(unsigned long long &hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    
+    for(size_t k = 0; k < size; k++)
+    {
+        hash ^= bytes[k];
+        hash *= 1099511628211ULL;
+    }
+}
+
+template<typename T>
+void hash_value(unsigned long long &hash, const T &value)
+{
+    hash_bytes(hash, &value, sizeof(value));
+}
+
+// by coordinates, Point3D has a vtable pointer
+void hash_value(unsigned long long &hash, const Point3D &point)
+{
+    hash_value(hash, point.x);
+    hash_value(hash, point.y);
+    hash_value(hash, point.z);
+}
+
+unsigned long long get_checkpoint_hash(int num_of_passes, bool is_streaming)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    
+    hash_value(hash, image_width);
+    hash_value(hash, image_height);
+    hash_value(hash, render_camera.eye_pos);
+    hash_value(hash, render_camera.look);
+    hash_value(hash, render_camera.up);
+    hash_value(hash, render_camera.rght);
+    hash_value(hash, level_of_recursion);
+    hash_value(hash, num_of_passes);
+    hash_value(hash, light_samples_per_point);
+    hash_value(hash, sampler_type);
+    hash_value(hash, reflection_termination_mode);
+    hash_value(hash, reflection_contribution_threshold);
+    hash_value(hash, is_streaming);
+    
+    if(is_streaming) // the file holds tone mapped bytes
+    {
+        hash_value(hash, tone_mapping);
+        hash_value(hash, output_exposure);
+        hash_value(hash, output_gamma);
+    }
+    
+    for(int i = 0; i < (int) objects.size(); i++)
+    {
+        const Object *object = objects[i];
+        
+        hash_value(hash, object->reference_point);
+        for(int k = 0; k < (int) object->triangle_end_points.size(); k++) hash_value(hash, object->triangle_end_points[k]);
+        hash_bytes(hash, object->gen_obj_coefficients.data(), object->gen_obj_coefficients.size() * sizeof(double));
+        hash_value(hash, object->height);
+        hash_value(hash, object->width);
+        hash_value(hash, object->length);
+        hash_bytes(hash, object->color.data(), object->color.size() * sizeof(double));
+        hash_bytes(hash, object->reflection_coefficients.data(), object->reflection_coefficients.size() * sizeof(double));
+        hash_value(hash, object->shininess);
+    }
+    
+    for(int i = 0; i < (int) lights.size(); i++)
+    {
+        const Light &light = lights[i];
+        
+        hash_value(hash, light.source_light_position);
+        hash_bytes(hash, light.color.data(), light.color.size() * sizeof(double));
+        hash_value(hash, light.influence_radius);
+        hash_value(hash, light.shape);
+        hash_value(hash, light.sphere_radius);
+        hash_value(hash, light.quad_corner);
+        hash_value(hash, light.quad_edge_u);
+        hash_value(hash, light.quad_edge_v);
+        hash_value(hash, light.is_spotlight);
+        hash_value(hash, light.spot_direction);
+        hash_value(hash, light.spot_outer_angle);
+        hash_value(hash, light.spot_cos_inner);
+    }
+    return hash;
+}
+
+#define CHECKPOINT_HEADER_SIZE (5 * sizeof(int) + 2 * sizeof(unsigned long long))
+
+// first pixel and number of pixels of a band
+void get_checkpoint_band(const Checkpoint &checkpoint, int band, size_t &first_pixel, size_t &num_of_pixels)
+{
+    int first_row = band * checkpoint.band_rows;
+    
+    first_pixel = (size_t) first_row * image_width;
+    num_of_pixels = (size_t) min(checkpoint.band_rows, image_height - first_row) * image_width;
+}
+
+// Only the bands finished since the last save are written, each into its place in the file, and they are flushed
+// before the band bitmap marks them, so a kill at any point leaves a checkpoint whose marked bands are complete
+bool save_checkpoint(Checkpoint &checkpoint)
+{
+    fstream &file = checkpoint.file;
+    int num_of_bands = (int) checkpoint.completed_bands.size();
+    unsigned long long num_of_colors = checkpoint.colors.size();
+    
+    if(!file.is_open())
+    {
+        // header and an empty bitmap, the colors and hit objects follow at fixed offsets as their bands finish
+        file.open(checkpoint_file_name.c_str(), ios::binary | ios::in | ios::out | ios::trunc);
+        
+        int header[5] = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION, checkpoint.band_rows, num_of_bands, (int) checkpoint.hit_objects.size()};
+        vector<char> no_bands(num_of_bands, 0);
+        
+        file.write((const char *) header, sizeof(header));
+        file.write((const char *) &checkpoint.scene_hash, sizeof(checkpoint.scene_hash));
+        file.write((const char *) &num_of_colors, sizeof(num_of_colors));
+        file.write(no_bands.data(), num_of_bands);
+        checkpoint.saved_bands.assign(num_of_bands, 0);
+    }
+    
+    size_t colors_offset = CHECKPOINT_HEADER_SIZE + num_of_bands;
+    size_t hits_offset = colors_offset + num_of_colors * sizeof(float);
+    vector<int> new_bands;
+    
+    for(int band = 0; band < num_of_bands; band++)
+    {
+        if(checkpoint.completed_bands[band] && !checkpoint.saved_bands[band]) new_bands.push_back(band);
+    }
+    
+    for(int k = 0; num_of_colors > 0 && k < (int) new_bands.size(); k++) // a streaming capture has its pixels in the image
+    {
+        size_t first_pixel, num_of_pixels;
+        get_checkpoint_band(checkpoint, new_bands[k], first_pixel, num_of_pixels);
+        
+        file.seekp(colors_offset + 3 * first_pixel * sizeof(float));
+        file.write((const char *) &checkpoint.colors[3 * first_pixel], 3 * num_of_pixels * sizeof(float));
+        file.seekp(hits_offset + first_pixel * sizeof(int));
+        file.write((const char *) &checkpoint.hit_objects[first_pixel], num_of_pixels * sizeof(int));
+    }
+    file.flush();
+    
+    for(int k = 0; k < (int) new_bands.size(); k++)
+    {
+        file.seekp(CHECKPOINT_HEADER_SIZE + new_bands[k]);
+        file.put(1);
+        checkpoint.saved_bands[new_bands[k]] = 1;
+    }
+    file.flush();
+    
+    if(!file)
+    {
+        cout << "Could not write the checkpoint " << checkpoint_file_name << endl;
+        return false;
+    }
+    return true;
+}
+
+// a finished capture does not need its checkpoint any more
+void remove_checkpoint(Checkpoint &checkpoint)
+{
+    checkpoint.file.close();
+    remove(checkpoint_file_name.c_str());
+}
+
+// checkpoint comes with the hash, band_rows and sizes of the current capture, it is only filled in when they all match.
+// The file stays open, later saves add to it
+bool load_checkpoint(Checkpoint &checkpoint)
+{
+    fstream &file = checkpoint.file;
+    file.open(checkpoint_file_name.c_str(), ios::binary | ios::in | ios::out);
+    
+    if(!file)
+    {
+        cout << "No checkpoint to resume from, starting over" << endl;
+        file.close();
+        return false;
+    }
+    
+    int header[5];
+    unsigned long long scene_hash = 0, num_of_colors = 0;
+    int num_of_bands = (int) checkpoint.completed_bands.size();
+    
+    file.read((char *) header, sizeof(header));
+    file.read((char *) &scene_hash, sizeof(scene_hash));
+    file.read((char *) &num_of_colors, sizeof(num_of_colors));
+    
+    if(!file || header[0] != CHECKPOINT_MAGIC || header[1] != CHECKPOINT_VERSION || header[2] != checkpoint.band_rows || header[3] != num_of_bands
+       || header[4] != (int) checkpoint.hit_objects.size() || num_of_colors != checkpoint.colors.size() || scene_hash != checkpoint.scene_hash)
+    {
+        cout << "The checkpoint belongs to a different scene, camera or settings, starting over" << endl;
+        file.close();
+        return false;
+    }
+    
+    vector<char> completed_bands(num_of_bands);
+    size_t colors_offset = CHECKPOINT_HEADER_SIZE + num_of_bands;
+    size_t hits_offset = colors_offset + num_of_colors * sizeof(float);
+    
+    file.read(completed_bands.data(), num_of_bands);
+    
+    for(int band = 0; file && num_of_colors > 0 && band < num_of_bands; band++)
+    {
+        if(!completed_bands[band]) continue;
+        
+        size_t first_pixel, num_of_pixels;
+        get_checkpoint_band(checkpoint, band, first_pixel, num_of_pixels);
+        
+        file.seekg(colors_offset + 3 * first_pixel * sizeof(float));
+        file.read((char *) &checkpoint.colors[3 * first_pixel], 3 * num_of_pixels * sizeof(float));
+        file.seekg(hits_offset + first_pixel * sizeof(int));
+        file.read((char *) &checkpoint.hit_objects[first_pixel], num_of_pixels * sizeof(int));
+    }
+    
+    if(!file)
+    {
+        // the bands read so far are traced again and overwritten
+        cout << "The checkpoint is truncated, starting over" << endl;
+        file.close();
+        return false;
+    }
+    
+    checkpoint.completed_bands = completed_bands;
+    checkpoint.saved_bands = completed_bands;
+    cout << "Resuming with " << count(completed_bands.begin(), completed_bands.end(), 1) << " of " << num_of_bands << " bands done" << endl;
+    return true;
+}
+
+// true every checkpoint_interval seconds
+bool is_checkpoint_due(chrono::steady_clock::time_point &last_checkpoint)
+{
+    if(checkpoint_interval <= 0) return false;
+    
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if(chrono::duration<double>(now - last_checkpoint).count() < checkpoint_interval) return false;
+    
+    last_checkpoint = now;
+    return true;
+}
+
+// traces the bands of the frame the checkpoint does not have, frame_colors gets the averaged colors of all of them
+long long capture_bands(const Point3D &top_left, double du, double dv, int num_of_passes, vector<float> &frame_colors, vector<int> &frame_hits)
+{
+    int num_of_bands = (image_height + STREAMING_BAND_ROWS - 1) / STREAMING_BAND_ROWS;
+    
+    Checkpoint checkpoint;
+    checkpoint.scene_hash = get_checkpoint_hash(num_of_passes, false);
+    checkpoint.band_rows = STREAMING_BAND_ROWS;
+    checkpoint.completed_bands.assign(num_of_bands, 0);
+    checkpoint.colors.assign(3 * image_width * image_height, 0.0f);
+    checkpoint.hit_objects.assign(image_width * image_height, -1);
+    
+    if(resume_capture) load_checkpoint(checkpoint);
+    
+    vector<float> band_colors;
+    vector<int> band_hits;
+    long long num_of_rays = 0;
+    chrono::steady_clock::time_point last_checkpoint = chrono::steady_clock::now();
+    
+    capture_steps_total = num_of_bands;
+    capture_steps_done = (int) count(checkpoint.completed_bands.begin(), checkpoint.completed_bands.end(), 1);
+    
+    for(int band = 0; band < num_of_bands && !is_render_cancelled(); band++)
+    {
+        if(checkpoint.completed_bands[band]) continue;
+        
+        int first_row = band * STREAMING_BAND_ROWS;
+        int num_of_rows = min(STREAMING_BAND_ROWS, image_height - first_row);
+        int first_pixel = first_row * image_width;
+        
+        num_of_rays += trace_band(top_left, du, dv, first_row, num_of_rows, num_of_passes, band_colors, band_hits);
+        if(is_render_cancelled()) break; // the band is incomplete
+        
+        copy(band_colors.begin(), band_colors.end(), checkpoint.colors.begin() + 3 * first_pixel);
+        copy(band_hits.begin(), band_hits.end(), checkpoint.hit_objects.begin() + first_pixel);
+        checkpoint.completed_bands[band] = 1;
+        capture_steps_done++;
+        
+        if(band + 1 < num_of_bands && is_checkpoint_due(last_checkpoint)) save_checkpoint(checkpoint);
+    }
+    
+    if(is_render_cancelled())
+    {
+        if(checkpoint_interval > 0) save_checkpoint(checkpoint); // the finished bands are kept for --resume
+        return num_of_rays;
+    }
+    
+    remove_checkpoint(checkpoint);
+    frame_colors.swap(checkpoint.colors);
+    frame_hits.swap(checkpoint.hit_objects);
+    return num_of_rays;
+}
+
+void capture_streaming()
+{
+    if(out_of_core_rendering) page_out_geometry();
+    
+    Point3D top_left;
+    double du, dv;
+    prepare_frame(top_left, du, dv);
+    
+    int band_rows = STREAMING_BAND_ROWS;
+    if(out_of_core_rendering)
+    {
+        size_t rows_in_budget = memory_cap_bytes / 4 / ((size_t) image_width * STREAMING_BYTES_PER_PIXEL);
+        band_rows = (int) max((size_t) 1, min(rows_in_budget, (size_t) STREAMING_BAND_ROWS));
+    }
+    
+    int num_of_passes = light_samples_per_point > 0 ? max(1, light_sampling_passes) : 1;
+    int num_of_bands = (image_height + band_rows - 1) / band_rows;
+    
+    Checkpoint checkpoint;
+    checkpoint.scene_hash = get_checkpoint_hash(num_of_passes, true);
+    checkpoint.band_rows = band_rows;
+    checkpoint.completed_bands.assign(num_of_bands, 0);
+    
+    bool is_resumed = resume_capture && load_checkpoint(checkpoint);
+    
+    if(is_resumed)
+    {
+        // the checkpoint only lists the bands, their pixels are in the partial bitmap
+        int top_band = (int) (find(checkpoint.completed_bands.begin(), checkpoint.completed_bands.end(), 1) - checkpoint.completed_bands.begin());
+        
+        if(top_band < num_of_bands && !StreamingBitmapWriter::has_rows("1605084_ray_tracing.bmp", image_width, image_height, top_band * band_rows))
+        {
+            cout << "The partial image of the checkpoint is missing or shorter than its finished bands, starting over" << endl;
+            checkpoint.completed_bands.assign(num_of_bands, 0);
+            checkpoint.file.close(); // the next save starts a new one
+            is_resumed = false;
+        }
+    }
+    
+    StreamingBitmapWriter writer;
+    if(!writer.open("1605084_ray_tracing.bmp", image_width, image_height, is_resumed)) return;
+    
+    vector<float> band_colors;
+    vector<int> band_hits;
+    vector<unsigned char> band_bytes;
+    long long num_of_rays = 0;
+    chrono::steady_clock::time_point last_checkpoint = chrono::steady_clock::now();
+    
+    capture_steps_total = num_of_bands;
+    capture_steps_done = (int) count(checkpoint.completed_bands.begin(), checkpoint.completed_bands.end(), 1);
+    streaming_peak_resident_memory = get_resident_memory();
+    
+    // bottom band first
+    for(int band = num_of_bands - 1; band >= 0 && !is_render_cancelled(); band--)
+    {
+        if(checkpoint.completed_bands[band]) continue;
+        
+        int first_row = band * band_rows;
+        int num_of_rows = min(band_rows, image_height - first_row);
+        
+        num_of_rays += trace_band(top_left, du, dv, first_row, num_of_rows, num_of_passes, band_colors, band_hits);
+        if(is_render_cancelled()) break;
+        
+        band_bytes.resize(3 * num_of_rows * image_width);
+        tonemap_rows(band_colors.data(), num_of_rows, band_bytes.data(), 3 * image_width);
+        writer.write_band(first_row, num_of_rows, band_bytes.data());
+        checkpoint.completed_bands[band] = 1;
+        capture_steps_done++;
+        streaming_peak_resident_memory = max(streaming_peak_resident_memory, get_resident_memory());
+        trim_paged_memory();
+        
+        if(band > 0 && is_checkpoint_due(last_checkpoint))
+        {
+            writer.flush(); // the bands have to be in the file before the checkpoint says so
+            save_checkpoint(checkpoint);
+        }
+    }
+    
+    writer.close();
+    
+    if(is_render_cancelled())
+    {
+        if(checkpoint_interval > 0) save_checkpoint(checkpoint); // the file has the finished bands, --resume continues it
+        return;
+    }
+    
+    remove_checkpoint(checkpoint);
+    cout << "Primary rays: " << num_of_rays << " (" << (double) num_of_rays / ((double) image_width * image_height) << " per pixel), streamed in bands of " << band_rows << " rows" << endl;
+    
+    if(out_of_core_rendering)
+    {
+        double megabyte = 1024.0 * 1024.0;
+        size_t peak = get_peak_resident_memory();
+        
+        ios::fmtflags flags = cout.flags();
+        cout << fixed << setprecision(1);
+        cout << "Peak resident memory: " << peak / megabyte << " MB of a " << memory_cap_bytes / megabyte << " MB cap" << (peak <= memory_cap_bytes ? "" : " (over)");
+        cout << ", paged: triangle vertices " << geometry_page_file.size() / megabyte << " MB, occluder grids " << occluder_page_file.size() / megabyte << " MB" << endl;
+        
+        int num_of_unpaged_objects = 0;
+        for(int i = 0; i < (int) objects.size(); i++)
+        {
+            if(objects[i]->triangle_end_points.size() == 0) num_of_unpaged_objects++;
+        }
+        cout << "Not paged: " << num_of_unpaged_objects << " of " << objects.size() << " objects (spheres, quadrics, the floor) and " << lights.size() << " lights" << endl;
+        cout.flags(flags);
+    }
+}
+
+/*
+ Crop window capture: only the pixels of crop_window are traced, with the camera of the whole frame, so they
+ come out exactly as in a full capture. With adaptive supersampling a one pixel border is traced as well,
+ the edge test of the window pixels needs their neighbours. The window is written on its own, or
+ composited into crop_target_file when that is a full frame of the same size.
+ */
+void capture_crop()
+{
+    PixelWindow window = crop_window;
+    window.x = max(0, min(window.x, image_width - 1));
+    window.y = max(0, min(window.y, image_height - 1));
+    window.width = max(1, min(window.width, image_width - window.x));
+    window.height = max(1, min(window.height, image_height - window.y));
+    
+    int border = adaptive_supersampling ? 1 : 0;
+    PixelWindow traced = {max(0, window.x - border), max(0, window.y - border), 0, 0};
+    traced.width = min(image_width, window.x + window.width + border) - traced.x;
+    traced.height = min(image_height, window.y + window.height + border) - traced.y;
+    
+    Point3D top_left;
+    double du, dv;
+    prepare_frame(top_left, du, dv);
+    
+    int num_of_passes = light_samples_per_point > 0 ? max(1, light_sampling_passes) : 1;
+    vector<float> band_colors;
+    vector<int> band_hits;
+    
+    capture_steps_total = 1;
+    long long num_of_rays = trace_band(top_left, du, dv, traced.y, traced.height, num_of_passes, band_colors, band_hits, traced.x, traced.width);
+    
+    if(adaptive_supersampling)
+    {
+        num_of_rays += refine_pixel_edges(top_left, du, dv, num_of_passes, band_colors, band_hits, &window, traced.y);
+    }
+    if(is_render_cancelled()) return;
+    capture_steps_done = 1;
+    
+    cout << "Primary rays: " << num_of_rays << " (" << (double) num_of_rays / ((double) window.width * window.height) << " per pixel of the " << window.width << "x" << window.height << " crop window)" << endl;
+    
+    // tone map the rows of the window, then cut out its columns
+    const float *window_colors = &band_colors[3 * (size_t) (window.y - traced.y) * image_width];
+    vector<unsigned char> row_bytes(3 * (size_t) window.height * image_width);
+    tonemap_rows(window_colors, window.height, row_bytes.data(), 3 * image_width);
+    
+    bitmap_image region(window.width, window.height);
+    for(int i = 0; i < window.height; i++)
+    {
+        const unsigned char *begin = &row_bytes[3 * ((size_t) i * image_width + window.x)];
+        copy(begin, begin + 3 * window.width, region.row(i));
+    }
+    
+    if(crop_target_file.empty())
+    {
+        region.save_image("1605084_ray_tracing_crop.bmp");
+        return;
+    }
+    
+    bitmap_image target(crop_target_file);
+    
+    if(!target || target.width() != (unsigned int) image_width || target.height() != (unsigned int) image_height)
+    {
+        cout << crop_target_file << " is not a " << image_width << "x" << image_height << " image, the crop window is written to 1605084_ray_tracing_crop.bmp" << endl;
+        region.save_image("1605084_ray_tracing_crop.bmp");
+        return;
+    }
+    
+    target.copy_from(region, window.x, window.y);
+    target.save_image(crop_target_file);
+}
+
+// captures render_camera
+void render_capture()
+{
+    if(crop_window.width > 0 && crop_window.height > 0)
+    {
+        capture_crop();
+        return;
+    }
+    
+    if(streaming_capture || out_of_core_rendering)
+    {
+        capture_streaming(); // progressive refinement and AA need the whole frame, they are skipped
+        return;
+    }
+    
+    //initialize bitmap image and set background color to black
+    bitmap_image image(image_width, image_height); //col x row
+    
+    for(int i = 0; i < image_height; i++)
+    {
+        for(int j = 0; j < image_width; j++)
+        {
+            image.set_pixel(j, i, 0, 0, 0);
+        }
+    }
+
+    Point3D top_left;
+    double du, dv;
+    prepare_frame(top_left, du, dv);
+    
+    // sampled lights are noisy, average several passes. Progressive mode keeps adding jittered passes until converged
+    int num_of_passes = light_samples_per_point > 0 ? max(1, light_sampling_passes) : 1;
+    if(progressive_rendering) num_of_passes = max(1, progressive_max_passes);
+    
+    int num_of_pixels = image_width * image_height;
+    vector<float> accumulated_colors(3 * num_of_pixels, 0.0f);
+    vector<int> sample_counts(num_of_pixels, 0), pixels(num_of_pixels);
+    vector<int> frame_hits(num_of_pixels, -1); // object hit by the last sample of every pixel, for refine_pixel_edges()
+    long long num_of_rays = 0; // primary rays
+    int completed_passes = 0;
+    bitmap_image previous_image;
+    chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+    
+    for(int k = 0; k < num_of_pixels; k++)
+    {
+        pixels[k] = k;
+    }
+    
+    // without progressive refinement every pixel gets every pass, the frame is traced band by band with checkpoints
+    if(!progressive_rendering)
+    {
+        num_of_rays = capture_bands(top_left, du, dv, num_of_passes, accumulated_colors, frame_hits);
+        completed_passes = num_of_passes;
+    }
+    else capture_steps_total = num_of_passes;
+    
+    while(progressive_rendering && !is_render_cancelled() && completed_passes < num_of_passes && !pixels.empty())
+    {
+        trace_progressive_pass(top_left, du, dv, pixels, sample_counts, accumulated_colors, frame_hits);
+        num_of_rays += pixels.size();
+        completed_passes++;
+        capture_steps_done = completed_passes;
+        
+        // compare the 8-bit image of this pass with the previous one
+        vector<float> average_colors(3 * num_of_pixels);
+        for(int k = 0; k < (int) average_colors.size(); k++)
+        {
+            average_colors[k] = accumulated_colors[k] / sample_counts[k / 3];
+        }
+        tonemap_to_image(average_colors, image);
+        
+        double elapsed_seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+        
+        if(completed_passes > 1)
+        {
+            double psnr = image.psnr(previous_image);
+            
+            // only the regions that still change get samples in the next pass
+            pixels.clear();
+            find_changing_regions(0, 0, image_width, image_height, image, previous_image, progressive_target_psnr, pixels);
+            
+            cout << "Pass " << completed_passes << ": PSNR " << psnr << " dB, " << pixels.size() << " pixels still changing, " << elapsed_seconds << " s" << endl;
+        }
+        
+        if(elapsed_seconds >= progressive_time_budget)
+        {
+            cout << "Time budget reached after " << completed_passes << " passes" << endl;
+            break;
+        }
+        previous_image = image;
+    }
+    
+    for(int k = 0; progressive_rendering && k < (int) accumulated_colors.size(); k++)
+    {
+        accumulated_colors[k] /= sample_counts[k / 3];
+    }
+    
+    if(adaptive_supersampling && !is_render_cancelled())
+    {
+        num_of_rays += refine_pixel_edges(top_left, du, dv, completed_passes, accumulated_colors, frame_hits);
+    }
+    
+    if(is_render_cancelled()) return;
+    
+    cout << "Primary rays: " << num_of_rays << " (" << (double) num_of_rays / (image_width * image_height) << " per pixel)" << endl;
+
+    framebuffer.swap(accumulated_colors);
+    tonemap_to_image(framebuffer, image);
+    image.save_image("1605084_ray_tracing.bmp");
+    image.clear();
+}
+
+/*
+ Last level cache misses of this process and the threads it starts after start(), from perf_event_open on
+ Linux. stop() returns -1 where the counter is not available (other platforms, perf_event_paranoid above 2,
+ no hardware counters in a virtual machine).
+ */
+class CacheMissCounter{
+    int descriptor;
+    
+public:
+    CacheMissCounter()
+    {
+        descriptor = -1;
+#ifdef __linux__
+        perf_event_attr attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+        attributes.disabled = 1;
+        attributes.inherit = 1; // parallel_for() starts new workers for every pass
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        descriptor = (int) syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+#endif
+    }
+    
+    void start()
+    {
+#ifdef __linux__
+        if(descriptor < 0) return;
+        ioctl(descriptor, PERF_EVENT_IOC_RESET, 0);
+        ioctl(descriptor, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+    
+    // misses since start(), the workers must have finished
+    long long stop()
+    {
+        long long misses = -1;
+#ifdef __linux__
+        if(descriptor < 0) return -1;
+        ioctl(descriptor, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(descriptor, &misses, sizeof(misses)) != sizeof(misses)) misses = -1;
+#endif
+        return misses;
+    }
+    
+    ~CacheMissCounter()
+    {
+#ifdef __linux__
+        if(descriptor >= 0) close(descriptor);
+#endif
+    }
+};
+
+// traces the frame of render_camera in every pixel order and prints the best of BENCHMARK_RUNS timings
+// with the cache misses of that run
+#define BENCHMARK_RUNS 3
+
+void benchmark_pixel_orders()
+{
+    Point3D top_left;
+    double du, dv;
+    prepare_frame(top_left, du, dv);
+    
+    int num_of_pixels = image_width * image_height;
+    vector<int> pixels(num_of_pixels), sample_counts(num_of_pixels, 0), hit_objects;
+    vector<float> pixel_colors;
+    int saved_order = pixel_order;
+    double row_major_seconds = 0.0;
+    ios_base::fmtflags saved_flags = cout.flags();
+    streamsize saved_precision = cout.precision();
+    
+    for(int k = 0; k < num_of_pixels; k++)
+    {
+        pixels[k] = k;
+    }
+    
+    CacheMissCounter cache_misses;
+    long long row_major_misses = -1;
+    
+    for(int order = 0; order < NUM_OF_PIXEL_ORDERS; order++)
+    {
+        double best_seconds = numeric_limits<double>::max();
+        long long best_misses = -1;
+        pixel_order = order;
+        
+        for(int run = 0; run < BENCHMARK_RUNS; run++)
+        {
+            chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+            cache_misses.start();
+            trace_frame(top_left, du, dv, false, pixels, sample_counts, pixel_colors, hit_objects);
+            long long misses = cache_misses.stop();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+            
+            if(seconds < best_seconds)
+            {
+                best_seconds = seconds;
+                best_misses = misses;
+            }
+        }
+        if(order == ORDER_ROW_MAJOR)
+        {
+            row_major_seconds = best_seconds;
+            row_major_misses = best_misses;
+        }
+        
+        cout << setw(10) << get_pixel_order_name(order) << ": " << setprecision(2) << fixed << best_seconds * 1000 << " ms, "
+             << num_of_pixels / best_seconds / 1e6 << " Mrays/s, " << row_major_seconds / best_seconds << "x row major, cache misses: ";
+        if(best_misses < 0) cout << "n/a" << endl;
+        else if(row_major_misses > 0) cout << best_misses << " (" << (double) best_misses / row_major_misses << "x row major)" << endl;
+        else cout << best_misses << endl;
+    }
+    pixel_order = saved_order;
+    cout.flags(saved_flags);
+    cout.precision(saved_precision);
+}
+
+// traces the frame of render_camera with the workers spread over 1, 2, ... all NUMA nodes
+void report_numa_scaling()
+{
+    bool saved_numa_rendering = numa_rendering;
+    int saved_active_nodes = numa_active_nodes, saved_threads = num_of_worker_threads;
+    int num_of_nodes = get_num_of_numa_nodes();
+    int threads_per_node = max(1, (int) thread::hardware_concurrency() / num_of_nodes);
+    
+    int num_of_pixels = image_width * image_height;
+    vector<int> pixels(num_of_pixels), sample_counts(num_of_pixels, 0), hit_objects;
+    vector<float> pixel_colors;
+    double one_node_seconds = 0.0;
+    ios_base::fmtflags saved_flags = cout.flags();
+    streamsize saved_precision = cout.precision();
+    
+    for(int k = 0; k < num_of_pixels; k++)
+    {
+        pixels[k] = k;
+    }
+    
+    numa_rendering = true;
+    cout << num_of_nodes << " NUMA node(s), " << threads_per_node << " thread(s) per node" << endl;
+    
+    for(int nodes = 1; nodes <= num_of_nodes; nodes++)
+    {
+        Point3D top_left;
+        double du, dv, best_seconds = numeric_limits<double>::max();
+        
+        numa_active_nodes = nodes;
+        num_of_worker_threads = nodes * threads_per_node;
+        prepare_frame(top_left, du, dv); // replicas for the active nodes
+        
+        for(int run = 0; run < BENCHMARK_RUNS; run++)
+        {
+            chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+            trace_frame(top_left, du, dv, false, pixels, sample_counts, pixel_colors, hit_objects);
+            best_seconds = min(best_seconds, chrono::duration<double>(chrono::steady_clock::now() - start_time).count());
+        }
+        if(nodes == 1) one_node_seconds = best_seconds;
+        
+        double speedup = one_node_seconds / best_seconds;
+        cout << setw(3) << nodes << " node(s), " << setw(4) << num_of_worker_threads << " threads: " << setprecision(2) << fixed
+             << best_seconds * 1000 << " ms, " << speedup << "x, " << speedup / nodes * 100 << "% efficiency" << endl;
+    }
+    
+    numa_rendering = saved_numa_rendering;
+    numa_active_nodes = saved_active_nodes;
+    num_of_worker_threads = saved_threads;
+    cout.flags(saved_flags);
+    cout.precision(saved_precision);
+}
+
+// streams the frame of render_camera without a cap and then under each of MEMORY_BENCHMARK_CAPS, and prints
+// the time and the largest resident memory seen between bands (the process peak only ever grows)
+#define MEMORY_BENCHMARK_CAPS {1024, 256, 64, 16} // megabytes
+
+void benchmark_memory_caps()
+{
+    bool saved_out_of_core = out_of_core_rendering;
+    size_t saved_cap = memory_cap_bytes;
+    double saved_interval = checkpoint_interval;
+    bool saved_resume = resume_capture;
+    int caps[] = MEMORY_BENCHMARK_CAPS;
+    double megabyte = 1024.0 * 1024.0, uncapped_seconds = 0.0;
+    ios_base::fmtflags saved_flags = cout.flags();
+    streamsize saved_precision = cout.precision();
+    
+    checkpoint_interval = 0.0;
+    resume_capture = false;
+    
+    // the uncapped run comes first, the geometry stays paged once a capped run moved it out
+    for(int k = -1; k < (int) (sizeof(caps) / sizeof(caps[0])); k++)
+    {
+        out_of_core_rendering = k >= 0;
+        memory_cap_bytes = k >= 0 ? (size_t) (caps[k] * megabyte) : 0;
+        
+        chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+        capture_streaming();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+        if(k < 0) uncapped_seconds = seconds;
+        
+        if(k < 0) cout << " no cap";
+        else cout << setw(4) << caps[k] << " MB";
+        cout << ": " << fixed << setprecision(2) << seconds * 1000 << " ms (" << seconds / uncapped_seconds << "x), resident memory up to "
+             << setprecision(1) << streaming_peak_resident_memory / megabyte << " MB" << endl;
+    }
+    
+    out_of_core_rendering = saved_out_of_core;
+    memory_cap_bytes = saved_cap;
+    checkpoint_interval = saved_interval;
+    resume_capture = saved_resume;
+    cout.flags(saved_flags);
+    cout.precision(saved_precision);
+}
+
+/*
+ Regression check (--self-test). A capture of render_camera on the default path is the reference, then the
+ other paths capture the same frame and have to write the same bytes: the wavefront renderer, the Morton and
+ Hilbert orders, streaming, a capture cancelled after a few bands and resumed from its checkpoint (banded
+ and streamed), and --gamma, which is compared with the reference tone mapped on a single thread. Every
+ capture runs on SELF_TEST_THREADS workers. Progressive rendering, adaptive supersampling, the crop window
+ and the memory cap are turned off, they trace other samples. The test writes 1605084_ray_tracing.bmp.
+ */
+#define SELF_TEST_THREADS 4
+#define SELF_TEST_CANCEL_STEPS 3 // bands done when a capture that is resumed afterwards is cancelled
+#define SELF_TEST_GAMMA 2.2f
+
+// number of bytes that differ between the image in file_name and expected, -1 when the sizes differ
+long long count_different_bytes(const string &file_name, bitmap_image &expected)
+{
+    bitmap_image image(file_name);
+    
+    if(!image || image.width() != expected.width() || image.height() != expected.height()) return -1;
+    
+    const unsigned char *bytes = image.data(), *expected_bytes = expected.data();
+    size_t num_of_bytes = (size_t) image.bytes_per_pixel() * image.width() * image.height();
+    long long count = 0;
+    
+    for(size_t k = 0; k < num_of_bytes; k++)
+    {
+        if(bytes[k] != expected_bytes[k]) count++;
+    }
+    return count;
+}
+
+// captures render_camera on a thread of its own and cancels it after SELF_TEST_CANCEL_STEPS bands,
+// the checkpoint keeps them
+void capture_and_cancel()
+{
+    atomic<bool> cancelled(false), is_finished(false);
+    
+    capture_steps_done = 0;
+    thread worker([&]() {
+        render_cancel_flag = &cancelled;
+        render_capture();
+        is_finished = true;
+    });
+    
+    while(!is_finished && capture_steps_done < SELF_TEST_CANCEL_STEPS)
+    {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    cancelled = true;
+    worker.join();
+}
+
+// returns the number of paths whose image differs from the reference
+int run_self_test()
+{
+    bool saved_wavefront = wavefront_rendering, saved_streaming = streaming_capture, saved_resume = resume_capture;
+    bool saved_progressive = progressive_rendering, saved_supersampling = adaptive_supersampling, saved_out_of_core = out_of_core_rendering;
+    int saved_order = pixel_order, saved_threads = num_of_worker_threads;
+    float saved_gamma = output_gamma;
+    double saved_interval = checkpoint_interval;
+    PixelWindow saved_crop = crop_window;
+    string saved_checkpoint_file = checkpoint_file_name;
+    
+    // the reference: recursive, row major, whole frame in memory
+    wavefront_rendering = streaming_capture = resume_capture = false;
+    progressive_rendering = adaptive_supersampling = out_of_core_rendering = false;
+    pixel_order = ORDER_ROW_MAJOR;
+    num_of_worker_threads = SELF_TEST_THREADS;
+    output_gamma = 1.0f;
+    checkpoint_interval = 0.0;
+    crop_window.width = 0;
+    checkpoint_file_name = "1605084_self_test.checkpoint"; // leaves the checkpoint of a real capture alone
+    
+    render_capture();
+    bitmap_image reference("1605084_ray_tracing.bmp");
+    vector<float> reference_colors = framebuffer;
+    
+    const char *names[] = {"wavefront", "morton order", "hilbert order", "streaming", "checkpoint + resume", "streamed checkpoint + resume", "gamma", "streamed gamma"};
+    int num_of_cases = (int) (sizeof(names) / sizeof(names[0]));
+    int num_of_failures = 0;
+    
+    for(int k = 0; k < num_of_cases; k++)
+    {
+        bitmap_image *expected = &reference;
+        bitmap_image gamma_reference;
+        
+        wavefront_rendering = k == 0;
+        pixel_order = k == 1 ? ORDER_MORTON : (k == 2 ? ORDER_HILBERT : ORDER_ROW_MAJOR);
+        streaming_capture = k == 3 || k == 5 || k == 7;
+        output_gamma = k >= 6 ? SELF_TEST_GAMMA : 1.0f;
+        
+        if(k == 4 || k == 5)
+        {
+            checkpoint_interval = 0.001; // a checkpoint after every band
+            resume_capture = false;
+            capture_and_cancel();
+            resume_capture = true;
+        }
+        render_capture();
+        checkpoint_interval = 0.0;
+        resume_capture = false;
+        
+        if(k >= 6)
+        {
+            gamma_reference.setwidth_height(image_width, image_height);
+            num_of_worker_threads = 1;
+            tonemap_to_image(reference_colors, gamma_reference);
+            num_of_worker_threads = SELF_TEST_THREADS;
+            expected = &gamma_reference;
+        }
+        
+        long long num_of_different_bytes = count_different_bytes("1605084_ray_tracing.bmp", *expected);
+        
+        cout << "Self test, " << names[k] << ": ";
+        if(num_of_different_bytes == 0) cout << "same image" << endl;
+        else if(num_of_different_bytes < 0) cout << "FAILED, the image is missing or has another size" << endl;
+        else cout << "FAILED, " << num_of_different_bytes << " bytes differ" << endl;
+        
+        if(num_of_different_bytes != 0) num_of_failures++;
+    }
+    
+    // the last image is one of the paths, the reference goes back to the output file
+    reference.save_image("1605084_ray_tracing.bmp");
+    cout << "Self test: " << (num_of_failures == 0 ? "passed" : to_string(num_of_failures) + " path(s) failed") << endl;
+    
+    wavefront_rendering = saved_wavefront;
+    streaming_capture = saved_streaming;
+    resume_capture = saved_resume;
+    progressive_rendering = saved_progressive;
+    adaptive_supersampling = saved_supersampling;
+    out_of_core_rendering = saved_out_of_core;
+    pixel_order = saved_order;
+    num_of_worker_threads = saved_threads;
+    output_gamma = saved_gamma;
+    checkpoint_interval = saved_interval;
+    crop_window = saved_crop;
+    checkpoint_file_name = saved_checkpoint_file;
+    return num_of_failures;
+}
+
+// captures the current camera on the calling thread
+void capture()
+{
+    render_camera = get_current_camera();
+    render_capture();
+}
+
+/*
+ Preview mode ('v'): the window shows the ray traced frame of the current camera instead of the OpenGL
+ approximation. It is traced on a background thread like a capture: first one pixel in every
+ PREVIEW_START_SCALE x PREVIEW_START_SCALE block, then the spacing halves until every pixel has its first
+ sample, which is the frame a capture writes. After that jittered passes are averaged in, up to
+ PREVIEW_MAX_PASSES. update_render_jobs() starts it over when the camera or a render setting changes, and
+ a capture pauses it.
+ */
+#define PREVIEW_START_SCALE 8
+#define PREVIEW_MAX_PASSES 64
+
+bool preview_mode = false;
+Camera preview_camera; // camera of the last preview started
+bool is_preview_current = false; // false once the preview of preview_camera has been stopped
+atomic<int> preview_passes(0); // samples per pixel so far, 0 while the low resolution levels are traced
+
+mutex preview_mutex; // guards preview_pixels and preview_version
+vector<unsigned char> preview_pixels; // RGB, top row first
+int preview_version = 0;
+int uploaded_preview_version = 0; // version in preview_texture
+GLuint preview_texture = 0;
+
+bool is_same_camera(const Camera &a, const Camera &b)
+{
+    const Point3D *points_a[] = {&a.eye_pos, &a.up, &a.rght, &a.look};
+    const Point3D *points_b[] = {&b.eye_pos, &b.up, &b.rght, &b.look};
+    
+    for(int k = 0; k < 4; k++)
+    {
+        if(points_a[k]->x != points_b[k]->x || points_a[k]->y != points_b[k]->y || points_a[k]->z != points_b[k]->z) return false;
+    }
+    return true;
+}
+
+// tone maps colors for the window, display() uploads them on the GLUT thread
+void publish_preview(const vector<float> &colors)
+{
+    vector<unsigned char> pixels(3 * (size_t) image_width * image_height);
+    tonemap_rows(colors.data(), image_height, pixels.data(), 3 * image_width);
+    
+    for(size_t k = 0; k < pixels.size(); k += 3)
+    {
+        swap(pixels[k], pixels[k + 2]); // BGR to RGB
+    }
+    
+    lock_guard<mutex> lock(preview_mutex);
+    preview_pixels.swap(pixels);
+    preview_version++;
+}
+
+void render_preview()
+{
+    Point3D top_left;
+    double du, dv;
+    prepare_frame(top_left, du, dv);
+    
+    int num_of_pixels = image_width * image_height;
+    vector<float> accumulated_colors(3 * num_of_pixels, 0.0f), display_colors(3 * num_of_pixels), pass_colors;
+    vector<int> sample_counts(num_of_pixels, 0), hit_objects, pixels;
+    
+    for(int scale = PREVIEW_START_SCALE; scale >= 1; scale /= 2)
+    {
+        pixels.clear();
+        for(int i = 0; i < image_height; i += scale)
+        {
+            for(int j = 0; j < image_width; j += scale)
+            {
+                if(sample_counts[i * image_width + j] == 0) pixels.push_back(i * image_width + j);
+            }
+        }
+        
+        trace_frame(top_left, du, dv, false, pixels, sample_counts, pass_colors, hit_objects);
+        if(is_render_cancelled()) return;
+        
+        for(int k = 0; k < (int) pixels.size(); k++)
+        {
+            for(int x = 0; x < 3; x++)
+            {
+                accumulated_colors[3 * pixels[k] + x] = pass_colors[3 * pixels[k] + x];
+            }
+            sample_counts[pixels[k]] = 1;
+        }
+        
+        // every pixel shows the sample at the top left of its scale x scale block
+        for(int i = 0; i < image_height; i++)
+        {
+            for(int j = 0; j < image_width; j++)
+            {
+                int sample = (i - i % scale) * image_width + (j - j % scale);
+                
+                for(int x = 0; x < 3; x++)
+                {
+                    display_colors[3 * (i * image_width + j) + x] = accumulated_colors[3 * sample + x];
+                }
+            }
+        }
+        publish_preview(display_colors);
+    }
+    preview_passes = 1;
+    
+    pixels.resize(num_of_pixels);
+    for(int k = 0; k < num_of_pixels; k++)
+    {
+        pixels[k] = k;
+    }
+    
+    for(int pass = 1; pass < PREVIEW_MAX_PASSES; pass++)
+    {
+        trace_frame(top_left, du, dv, true, pixels, sample_counts, pass_colors, hit_objects);
+        if(is_render_cancelled()) return;
+        
+        for(int k = 0; k < 3 * num_of_pixels; k++)
+        {
+            accumulated_colors[k] += pass_colors[k];
+            display_colors[k] = accumulated_colors[k] / (sample_counts[k / 3] + 1);
+        }
+        for(int k = 0; k < num_of_pixels; k++)
+        {
+            sample_counts[k]++;
+        }
+        
+        preview_passes = pass + 1;
+        publish_preview(display_colors);
+    }
+}
+
+// draws the latest preview over the whole window, false until there is one
+bool draw_preview()
 {
-    if(drawaxes == 1)
     {
-        glBegin(GL_LINES);
+        lock_guard<mutex> lock(preview_mutex);
+        
+        if(preview_pixels.empty()) return false;
+        
+        if(preview_texture == 0) glGenTextures(1, &preview_texture);
+        glBindTexture(GL_TEXTURE_2D, preview_texture);
+        
+        if(uploaded_preview_version != preview_version)
         {
-            //X - axis -- RED
-            glColor3f(1.0, 0, 0);
-            glVertex3f(150, 0, 0);
-            glVertex3f(-150, 0, 0);
-
-            //Y - axis --GREEN
-            glColor3f(0, 1, 0);
-            glVertex3f(0, -150, 0);
-            glVertex3f(0, 150, 0);
-
-            //Z - axis -- BLUE
-            glColor3f(0, 0, 1);
-            glVertex3f(0, 0, 150);
-            glVertex3f(0, 0, -150);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image_width, image_height, 0, GL_RGB, GL_UNSIGNED_BYTE, preview_pixels.data());
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+            uploaded_preview_version = preview_version;
         }
-        glEnd();
     }
+    
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_TEXTURE_2D);
+    
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0, 1, 0, 1, -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    
+    glColor3f(1, 1, 1);
+    glBegin(GL_QUADS);
+    {
+        // the first texture row is the top of the image
+        glTexCoord2f(0, 1); glVertex2f(0, 0);
+        glTexCoord2f(1, 1); glVertex2f(1, 0);
+        glTexCoord2f(1, 0); glVertex2f(1, 1);
+        glTexCoord2f(0, 0); glVertex2f(0, 1);
+    }
+    glEnd();
+    
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    
+    glDisable(GL_TEXTURE_2D);
+    glEnable(GL_DEPTH_TEST);
+    return true;
 }
 
-void look_left(double angle)
+/*
+ Background jobs. '0' starts a capture on its own thread and 'b' the pixel order benchmark, the workers of
+ parallel_for_dynamic() do the tracing, so the window keeps drawing and taking camera input meanwhile. The
+ preview runs the same way. Each job has its own cancel flag, which the renderer polls through
+ is_render_cancelled(), and the GLUT thread never waits for one: cancelling only raises the flag. What has to
+ wait until a job has stopped (a render setting it reads, the next capture, a new preview) is queued and
+ done by update_render_jobs() from animate(). A capture traces render_camera, copied when '0' is pressed,
+ progress shows in the window title and 'c' cancels. Pressing '0' again, or changing a render setting,
+ cancels the running capture and starts a new one. A cancelled capture writes no image but keeps its
+ checkpoint for --resume.
+ */
+struct RenderJob{
+    thread worker;
+    void (*body)(); // what the worker runs
+    atomic<bool> cancelled;
+    atomic<bool> is_running;
+    
+    RenderJob() : body(nullptr), cancelled(false), is_running(false) {}
+};
+
+RenderJob capture_job; // a capture or the benchmark
+RenderJob preview_job;
+
+void (*pending_capture)() = nullptr; // started on capture_job once no job is alive
+Camera pending_capture_camera;
+string pending_setting_keys; // pressed while a job was alive, applied once none is
+
+void start_job(RenderJob &job, void (*body)())
 {
-    //up fixed
-    look = look * cos(angle) + vector_cross_product(up, look) * sin(angle);
-    rght = rght * cos(angle) + vector_cross_product(up, rght) * sin(angle);
+    job.body = body;
+    job.cancelled = false;
+    job.is_running = true;
+    job.worker = thread([&job, body]() {
+        render_cancel_flag = &job.cancelled;
+        body();
+        job.is_running = false;
+    });
 }
 
-void look_right(double angle)
+// true while the thread of the job has not finished, it is joined (without waiting) once it has
+bool is_job_alive(RenderJob &job)
 {
-    look_left(-angle);
+    if(!job.worker.joinable()) return false;
+    if(job.is_running) return true;
+    
+    job.worker.join();
+    return false;
 }
 
-void look_up(double angle)
+// true when the job was running and had not been cancelled yet
+bool cancel_job(RenderJob &job)
 {
-    //right fixed
-    up = up * cos(angle) + vector_cross_product(rght, up) * sin(angle);
-    look = look * cos(angle) + vector_cross_product(rght, look) * sin(angle);
+    return is_job_alive(job) && !job.cancelled.exchange(true);
 }
 
-void look_down(double angle)
+// waits for the jobs, only at exit
+void stop_jobs_at_exit()
 {
-    look_up(-angle);
+    RenderJob *jobs[] = {&capture_job, &preview_job};
+    
+    for(int k = 0; k < 2; k++)
+    {
+        jobs[k]->cancelled = true;
+        if(jobs[k]->worker.joinable()) jobs[k]->worker.join();
+    }
 }
 
-void tilt_anticlockwise(double angle)
+// capture is render_capture() or benchmark_pixel_orders(), it traces the camera of the moment
+void request_capture(void (*capture)())
 {
-    //look fixed
-    up = up * cos(angle) + vector_cross_product(look, up) * sin(angle);
-    rght = rght * cos(angle) + vector_cross_product(look, rght) * sin(angle);
+    if(cancel_job(capture_job)) cout << "Capture restarted" << endl;
+    preview_job.cancelled = true; // a capture pauses the preview, it starts over afterwards
+    is_preview_current = false;
+    
+    pending_capture = capture;
+    pending_capture_camera = get_current_camera();
 }
 
-void tilt_clockwise(double angle)
+void start_preview()
 {
-    tilt_anticlockwise(-angle);
+    render_camera = preview_camera = get_current_camera();
+    is_preview_current = true;
+    preview_passes = 0;
+    start_job(preview_job, render_preview);
 }
 
-double degreeToRadianAngle(double degree)
+void apply_setting_key(unsigned char key);
+
+// called from animate()
+void update_render_jobs()
 {
-    return pi / 180 * degree;
+    bool has_pending_work = pending_capture != nullptr || !pending_setting_keys.empty();
+    
+    // the preview starts over when the camera has moved, and gives way to a capture or a setting change
+    if(is_preview_current && !is_same_camera(preview_camera, get_current_camera())) is_preview_current = false;
+    if(has_pending_work || !preview_mode || !is_preview_current) preview_job.cancelled = true;
+    
+    if(is_job_alive(capture_job) || is_job_alive(preview_job)) return;
+    
+    for(size_t k = 0; k < pending_setting_keys.size(); k++)
+    {
+        apply_setting_key(pending_setting_keys[k]);
+    }
+    pending_setting_keys.clear();
+    
+    if(pending_capture != nullptr)
+    {
+        render_camera = pending_capture_camera;
+        capture_steps_done = 0;
+        capture_steps_total = 0;
+        start_job(capture_job, pending_capture);
+        pending_capture = nullptr;
+        return;
+    }
+    
+    if(preview_mode && !is_preview_current) start_preview();
 }
 
-void capture()
+// called from animate(), GLUT windows may only be changed on the GLUT thread
+void update_capture_title()
 {
-    //initialize bitmap image and set background color to black
-    bitmap_image image(image_width, image_height); //col x row
+    static string title = WINDOW_TITLE;
+    string new_title = WINDOW_TITLE;
     
-    for(int i = 0; i < image_height; i++)
+    if(capture_job.is_running)
     {
-        for(int j = 0; j < image_width; j++)
-        {
-            image.set_pixel(j, i, 0, 0, 0);
-        }
+        int total = capture_steps_total;
+        int percent = total > 0 ? 100 * capture_steps_done / total : 0;
+        new_title += " - capturing " + to_string(percent) + "%, c cancels";
     }
+    else if(preview_mode)
+    {
+        int passes = preview_passes;
+        new_title += passes == 0 ? string(" - preview, low resolution") : " - preview, " + to_string(passes) + " samples per pixel";
+    }
+    
+    if(new_title != title)
+    {
+        glutSetWindowTitle(new_title.c_str());
+        title = new_title;
+    }
+}
 
-    double plane_distance = (WINDOW_HEIGHT / 2.0) / tan(degreeToRadianAngle(FOVY / 2.0));
-    Point3D top_left = eye_pos + look * plane_distance - rght * (WINDOW_WIDTH / 2.0) + up * (WINDOW_HEIGHT / 2.0);
-    double du = (double) WINDOW_WIDTH / image_width;
-    double dv = (double) WINDOW_HEIGHT / image_height;
-
-    // Choose middle of the grid cell
-    top_left = top_left + rght * (0.5 * du) - up * (0.5 * dv);
-
-    for(int i = 0; i < image_height; i++)
+// render settings read by the jobs, changed by update_render_jobs() once none is alive
+void apply_setting_key(unsigned char key)
+{
+    switch(key)
     {
-        for(int j = 0; j < image_width; j++)
-        {
-            int nearest = -1; //stores the nearest object index
-            double t;
-            double t_min = numeric_limits<double>::max();
-            vector<double> dummy_color(3);
+        case 'w':
+            wavefront_rendering = !wavefront_rendering;
+            cout << "Wavefront renderer: " << (wavefront_rendering ? "on" : "off") << endl;
+            break;
             
-            Point3D current_pixel = top_left + rght * (j * du) - up * (i * dv);
+        case 'a':
+            adaptive_supersampling = !adaptive_supersampling;
+            cout << "Adaptive supersampling: " << (adaptive_supersampling ? "on" : "off") << endl;
+            break;
             
-            //cast ray from eye to (curPixel-eye) direction
-            Ray ray(eye_pos, current_pixel - eye_pos);
+        case 'p':
+            progressive_rendering = !progressive_rendering;
+            cout << "Progressive rendering: " << (progressive_rendering ? "on" : "off") << endl;
+            break;
             
-            for(int k = 0; k < objects.size(); k++)
-            {
-                t = objects[k]->intersect(ray, dummy_color, 0);
-                
-                if(t < t_min && t > 0)
-                {
-                    t_min = t;
-                    nearest = k;
-                }
-            }
+        case 'l':
+            // off -> 1 -> 4 sampled lights per shading point
+            light_samples_per_point = light_samples_per_point == 0 ? 1 : (light_samples_per_point == 1 ? 4 : 0);
+            cout << "Sampled lights per point: " << (light_samples_per_point == 0 ? "all" : to_string(light_samples_per_point)) << endl;
+            break;
             
-            if(nearest != -1)
-            {
-                t_min = objects[nearest]->intersect(ray, dummy_color, 1);
-            }
+        case 's':
+            sampler_type = (sampler_type + 1) % NUM_OF_SAMPLERS;
+            cout << "Sampler: " << get_sampler_name() << endl;
+            break;
             
-            //Clip the color values so that they are in [0, 1] range.
-            for(int x = 0; x < 3; x++)
-            {
-                if(dummy_color[x] < 0.0) dummy_color[x] = 0.0;
-                else if(dummy_color[x] > 1.0) dummy_color[x] = 1.0;
-            }
+        case 'o':
+            pixel_order = (pixel_order + 1) % NUM_OF_PIXEL_ORDERS;
+            cout << "Pixel order: " << get_pixel_order_name(pixel_order) << endl;
+            break;
+            
+        case 'm':
+            tone_mapping = (tone_mapping + 1) % NUM_OF_TONEMAPS;
+            cout << "Tone mapping: " << get_tone_mapping_name() << endl;
+            break;
             
-            //update image pixel (i,j)
-            image.set_pixel(j, i, dummy_color[0] * 255, dummy_color[1] * 255, dummy_color[2] * 255);
-            dummy_color.clear();
+        case 't':
+        {
+            const char *mode_names[] = {"off", "threshold", "russian roulette"};
+            reflection_termination_mode = (reflection_termination_mode + 1) % 3;
+            cout << "Reflection termination: " << mode_names[reflection_termination_mode] << endl;
+            break;
         }
+            
+        default:
+            break;
     }
-    image.save_image("1605084_ray_tracing.bmp");
-    image.clear();
 }
 
 void keyboardListener(unsigned char key, int x,int y)
 {
+    // a running capture is restarted with the new setting, the preview by update_render_jobs()
+    if(string("waplsomt").find(key) != string::npos)
+    {
+        if(capture_job.is_running && !capture_job.cancelled) request_capture(capture_job.body);
+        preview_job.cancelled = true;
+        is_preview_current = false;
+        pending_setting_keys += key;
+        return;
+    }
+    
     switch(key)
     {
         case '0':
-            capture();
+            request_capture(render_capture);
+            break;
+            
+        case 'b':
+            request_capture(benchmark_pixel_orders);
+            break;
+            
+        case 'c':
+            pending_capture = nullptr;
+            if(cancel_job(capture_job)) cout << "Capture cancelled" << endl;
+            break;
+            
+        case 'v':
+            preview_mode = !preview_mode;
+            cout << "Ray traced preview: " << (preview_mode ? "on" : "off") << endl;
             break;
             
         case '1':
@@ -280,6 +2393,12 @@ void display()
     glClearColor(0, 0, 0, 0);    //color black
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     
+    if(preview_mode && draw_preview())
+    {
+        glutSwapBuffers();
+        return;
+    }
+    
     /* ******************* setup camera here ******************* */
     //load the correct matrix -- MODEL-VIEW matrix
     glMatrixMode(GL_MODELVIEW);
@@ -318,19 +2437,16 @@ void display()
 
 void animate()
 {
+    update_render_jobs();
+    update_capture_title();
     angle += 0.05;
     //codes for any changes in Models, Camera
     glutPostRedisplay();
 }
 
-void init()
+// the camera every run starts with, also the one the command line captures and benchmarks use
+void init_camera()
 {
-    //codes for initialization
-    drawaxes = 1;
-    cameraHeight = 150.0;
-    cameraAngle = 1.0;
-    angle = 0.0;
-
     //initialization of pos, u, r, l vectors
     eye_pos.x = eye_pos.y = 120;
     eye_pos.z = 20;
@@ -345,8 +2461,17 @@ void init()
     look.x = -1/sqrt(2.0);
     look.y = -1/sqrt(2.0);
     look.z = 0;
+}
 
+void init()
+{
+    //codes for initialization
+    drawaxes = 1;
+    cameraHeight = 150.0;
+    cameraAngle = 1.0;
+    angle = 0.0;
 
+    init_camera();
 
     //clear the screen
     glClearColor(0, 0, 0, 0);
@@ -382,6 +2507,7 @@ void load_data()
     cin >> image_height;
     cin >> num_of_objects;
     
+    if(image_size_override > 0) image_height = image_size_override;
     image_width = image_height;
     
     for(int i = 0; i < num_of_objects; i++)
@@ -448,9 +2574,61 @@ void load_data()
         Light light(source);
         
         light.set_color(R, G, B);
+        light.set_influence_radius(light_influence_radius);
+        
+        lights.push_back(light);
+    }
+    
+    // optional area lights and spotlights after the point lights:
+    //   sphere  center  radius  color
+    //   quad    corner  edge_u  edge_v  color
+    //   spot    position  direction  inner_angle  outer_angle (degrees)  color
+    int num_of_extra_lights = 0;
+    if(!(cin >> num_of_extra_lights)) num_of_extra_lights = 0;
+    
+    for(int i = 0; i < num_of_extra_lights; i++)
+    {
+        Light light;
+        
+        cin >> str;
+        
+        if(str == "sphere")
+        {
+            double radius;
+            
+            cin >> light.source_light_position.x >> light.source_light_position.y >> light.source_light_position.z;
+            cin >> radius;
+            light.set_sphere_shape(radius);
+        }
+        else if(str == "quad")
+        {
+            Point3D corner, edge_u, edge_v;
+            
+            cin >> corner.x >> corner.y >> corner.z;
+            cin >> edge_u.x >> edge_u.y >> edge_u.z;
+            cin >> edge_v.x >> edge_v.y >> edge_v.z;
+            light.set_quad_shape(corner, edge_u, edge_v);
+        }
+        else if(str == "spot")
+        {
+            Point3D direction;
+            double inner_angle, outer_angle;
+            
+            cin >> light.source_light_position.x >> light.source_light_position.y >> light.source_light_position.z;
+            cin >> direction.x >> direction.y >> direction.z;
+            cin >> inner_angle >> outer_angle;
+            light.set_spot_cone(direction, degreeToRadianAngle(inner_angle), degreeToRadianAngle(max(inner_angle, outer_angle)));
+        }
+        else break;
+        
+        cin >> R >> G >> B;
+        
+        light.set_color(R, G, B);
+        light.set_influence_radius(light_influence_radius);
         
         lights.push_back(light);
     }
+    num_of_light_sources = (int) lights.size();
     
     //Push Floor at last
     object = new Floor(1000, 20);
@@ -461,22 +2639,172 @@ void load_data()
 }
 
 
+// command line options, the ones GLUT understands are left for glutInit()
+void parse_arguments(int argc, char **argv)
+{
+    for(int i = 1; i < argc; i++)
+    {
+        string argument = argv[i];
+        
+        if(argument == "--light-radius" && i + 1 < argc)
+        {
+            light_influence_radius = atof(argv[++i]);
+        }
+        else if(argument == "--light-samples" && i + 1 < argc)
+        {
+            light_samples_per_point = min(MAX_LIGHT_SAMPLES, max(0, atoi(argv[++i])));
+        }
+        else if(argument == "--light-passes" && i + 1 < argc)
+        {
+            light_sampling_passes = atoi(argv[++i]);
+        }
+        else if(argument == "--wavefront")
+        {
+            wavefront_rendering = true;
+        }
+        else if(argument == "--progressive")
+        {
+            progressive_rendering = true;
+        }
+        else if(argument == "--target-psnr" && i + 1 < argc)
+        {
+            progressive_target_psnr = atof(argv[++i]);
+        }
+        else if(argument == "--time-budget" && i + 1 < argc)
+        {
+            progressive_time_budget = atof(argv[++i]);
+        }
+        else if(argument == "--sampler" && i + 1 < argc)
+        {
+            string name = argv[++i];
+            
+            if(name == "random") sampler_type = SAMPLER_RANDOM;
+            else if(name == "halton") sampler_type = SAMPLER_HALTON;
+            else if(name == "sobol") sampler_type = SAMPLER_SOBOL;
+            else if(name == "blue-noise") sampler_type = SAMPLER_BLUE_NOISE;
+        }
+        else if(argument == "--pixel-order" && i + 1 < argc)
+        {
+            string name = argv[++i];
+            
+            if(name == "row-major") pixel_order = ORDER_ROW_MAJOR;
+            else if(name == "morton") pixel_order = ORDER_MORTON;
+            else if(name == "hilbert") pixel_order = ORDER_HILBERT;
+        }
+        else if(argument == "--tonemap" && i + 1 < argc)
+        {
+            string name = argv[++i];
+            
+            if(name == "clamp") tone_mapping = TONEMAP_CLAMP;
+            else if(name == "reinhard") tone_mapping = TONEMAP_REINHARD;
+            else if(name == "aces") tone_mapping = TONEMAP_ACES;
+        }
+        else if(argument == "--exposure" && i + 1 < argc)
+        {
+            output_exposure = (float) atof(argv[++i]);
+        }
+        else if(argument == "--gamma" && i + 1 < argc)
+        {
+            output_gamma = max(0.01f, (float) atof(argv[++i]));
+        }
+        else if(argument == "--stream")
+        {
+            streaming_capture = true;
+        }
+        else if(argument == "--crop" && i + 4 < argc)
+        {
+            crop_window.x = atoi(argv[++i]);
+            crop_window.y = atoi(argv[++i]);
+            crop_window.width = atoi(argv[++i]);
+            crop_window.height = atoi(argv[++i]);
+        }
+        else if(argument == "--crop-into" && i + 1 < argc)
+        {
+            crop_target_file = argv[++i];
+        }
+        else if(argument == "--checkpoint-interval" && i + 1 < argc)
+        {
+            checkpoint_interval = atof(argv[++i]);
+        }
+        else if(argument == "--resume")
+        {
+            resume_capture = true;
+        }
+        else if(argument == "--memory-cap" && i + 1 < argc)
+        {
+            double megabytes = atof(argv[++i]);
+            out_of_core_rendering = megabytes > 0;
+            memory_cap_bytes = (size_t) (max(0.0, megabytes) * 1024 * 1024);
+        }
+        else if(argument == "--image-size" && i + 1 < argc)
+        {
+            image_size_override = max(0, atoi(argv[++i]));
+        }
+        else if(argument == "--threads" && i + 1 < argc)
+        {
+            num_of_worker_threads = max(0, atoi(argv[++i]));
+        }
+        else if(argument == "--benchmark-order")
+        {
+            benchmark_only = true;
+        }
+        else if(argument == "--memory-benchmark")
+        {
+            memory_benchmark_only = true;
+        }
+        else if(argument == "--capture")
+        {
+            capture_only = true;
+        }
+        else if(argument == "--self-test")
+        {
+            self_test_only = true;
+        }
+        else if(argument == "--numa")
+        {
+            numa_rendering = true;
+        }
+        else if(argument == "--numa-scaling")
+        {
+            numa_scaling_only = true;
+        }
+    }
+}
+
 int main(int argc, char **argv)
 {
+    parse_arguments(argc, argv);
+    
     /* *************** File Read **********************************/
     
     freopen("scene.txt", "r", stdin);
     load_data();
+    if(out_of_core_rendering) page_out_geometry(); // before the window draws the triangles from another thread
     
     /* project location---> cd Documents/Academics/4-1/"Computer Graphics Sessional"/Offline3/"Ray Tracing" */
     
     /* ***********************************************************/
+    
+    // batch runs need no window, they trace the camera a run starts with
+    if(capture_only || benchmark_only || numa_scaling_only || memory_benchmark_only || self_test_only)
+    {
+        init_camera();
+        render_camera = get_current_camera();
+        if(capture_only) render_capture();
+        if(benchmark_only) benchmark_pixel_orders();
+        if(numa_scaling_only) report_numa_scaling();
+        if(memory_benchmark_only) benchmark_memory_caps();
+        if(self_test_only && run_self_test() > 0) return 1;
+        return 0;
+    }
+    
     glutInit(&argc,argv);
     glutInitWindowSize(WINDOW_WIDTH , WINDOW_HEIGHT);
     glutInitWindowPosition(0, 0);
     glutInitDisplayMode(GLUT_DEPTH | GLUT_DOUBLE | GLUT_RGB);  //Depth, Double buffer, RGB color
 
-    glutCreateWindow("My OpenGL Ray Tracing Program");
+    glutCreateWindow(WINDOW_TITLE);
+    atexit(stop_jobs_at_exit);
 
     init();
 